@@ -0,0 +1,166 @@
+#include "adlibrary.h"
+#include "hash.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return ((value + alignment - 1)/alignment)*alignment;
+}
+
+AdLibrary::AdLibrary() : base(nullptr), mappedSize(0), header(nullptr), entries(nullptr),
+                         names(nullptr), frameBlock(nullptr) {}
+
+AdLibrary::~AdLibrary() {close();}
+
+void AdLibrary::close() {
+    if(base != nullptr) {munmap(base, mappedSize);}
+    base = nullptr;
+    mappedSize = 0;
+    header = nullptr;
+    entries = nullptr;
+    names = nullptr;
+    frameBlock = nullptr;
+}
+
+bool AdLibrary::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "ERROR: Couldn't open ad library " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(AdLibraryHeader)) {
+        std::cerr << "ERROR: " << path << " is too small to be an ad library" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after closing the descriptor
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        std::cerr << "ERROR: Couldn't map ad library " << path << std::endl;
+        return false;
+    }
+    base = mapped;
+    mappedSize = (size_t)st.st_size;
+    header = (const AdLibraryHeader *)base;
+    const char *bytes = (const char *)base;
+    // The names block runs from namesOffset to framesOffset. Sizes are checked by dividing, so a huge count can't
+    // wrap around into something that looks fine.
+    bool valid = std::memcmp(header->magic, AD_LIBRARY_MAGIC, sizeof(AD_LIBRARY_MAGIC)) == 0 &&
+                 header->version == AD_LIBRARY_VERSION &&
+                 header->fileSize == mappedSize &&
+                 header->frameStride > 0 && header->frameStride >= (uint64_t)header->frameW*header->frameH &&
+                 header->namesOffset >= sizeof(AdLibraryHeader) + header->adCount*sizeof(AdLibraryEntry) &&
+                 header->namesOffset <= header->framesOffset &&
+                 header->framesOffset % AD_LIBRARY_FRAME_ALIGN == 0 && header->framesOffset <= mappedSize &&
+                 header->totalSampled <= (mappedSize - header->framesOffset)/header->frameStride;
+    if(valid) {
+        // Every ad's name has to be in the names block and its frames in the frame block, in order (adOfFrame
+        // counts on that)
+        const AdLibraryEntry *table = (const AdLibraryEntry *)(bytes + sizeof(AdLibraryHeader));
+        uint64_t namesSize = header->framesOffset - header->namesOffset, nextFrame = 0;
+        for(uint32_t ad = 0; valid && ad < header->adCount; ad++) {
+            const AdLibraryEntry &entry = table[ad];
+            valid = entry.nameOffset <= namesSize && entry.nameLength <= namesSize - entry.nameOffset &&
+                    entry.firstFrame >= nextFrame && entry.firstFrame <= header->totalSampled &&
+                    entry.sampledFrames <= header->totalSampled - entry.firstFrame;
+            nextFrame = entry.firstFrame + entry.sampledFrames;
+        }
+    }
+    if(!valid) {
+        std::cerr << "ERROR: " << path << " isn't an ad library (or was written by another version)" << std::endl;
+        close();
+        return false;
+    }
+    entries = (const AdLibraryEntry *)(bytes + sizeof(AdLibraryHeader));
+    names = bytes + header->namesOffset;
+    frameBlock = (const uint8_t *)(bytes + header->framesOffset);
+    // The whole thing is going to be scanned front to back over and over, so let the kernel read ahead.
+    madvise(base, mappedSize, MADV_WILLNEED);
+    return true;
+}
+
+uint32_t AdLibrary::adOfFrame(uint64_t index) const {
+    // Ads are stored in order, so binary search for the last ad starting at or before the index
+    uint32_t low = 0, high = header->adCount;
+    while(high - low > 1) {
+        uint32_t mid = low + (high - low)/2;
+        if(entries[mid].firstFrame <= index) {low = mid;}
+        else {high = mid;}
+    }
+    return low;
+}
+
+uint64_t AdLibrary::fingerprint() const {
+    return fnv1a64(base, mappedSize);
+}
+
+
+AdLibraryBuilder::AdLibraryBuilder(uint32_t sampleRate, uint32_t frameW, uint32_t frameH,
+                                   uint32_t descriptorBackend) {
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, AD_LIBRARY_MAGIC, sizeof(AD_LIBRARY_MAGIC));
+    header.version = AD_LIBRARY_VERSION;
+    header.sampleRate = sampleRate;
+    header.frameW = frameW;
+    header.frameH = frameH;
+    header.descriptorBackend = descriptorBackend;
+    header.frameStride = (uint32_t)alignUp((uint64_t)frameW*frameH, 32);
+}
+
+void AdLibraryBuilder::addAd(const std::string &name, uint64_t totalFrames, double duration,
+                             const uint8_t *frames, uint64_t sampledFrames, uint64_t sourceStride) {
+    AdLibraryEntry entry;
+    entry.nameOffset = names.size();
+    entry.nameLength = name.size();
+    entry.firstFrame = header.totalSampled;
+    entry.sampledFrames = sampledFrames;
+    entry.totalFrames = totalFrames;
+    entry.duration = duration;
+    entries.push_back(entry);
+    names += name;
+    // Copy frame by frame since the block has padding at the end of every frame
+    uint64_t frameSize = (uint64_t)header.frameW*header.frameH;
+    if(sourceStride == 0) {sourceStride = frameSize;}
+    size_t start = frameData.size();
+    frameData.resize(start + sampledFrames*header.frameStride, 0);
+    for(uint64_t i = 0; i < sampledFrames; i++) {
+        std::memcpy(&frameData[start + i*header.frameStride], frames + i*sourceStride, frameSize);
+    }
+    header.totalSampled += sampledFrames;
+}
+
+bool AdLibraryBuilder::write(const std::string &path) const {
+    AdLibraryHeader out = header;
+    out.adCount = (uint32_t)entries.size();
+    out.namesOffset = sizeof(AdLibraryHeader) + entries.size()*sizeof(AdLibraryEntry);
+    out.framesOffset = alignUp(out.namesOffset + names.size(), AD_LIBRARY_FRAME_ALIGN);
+    out.fileSize = out.framesOffset + frameData.size();
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write((const char *)&out, sizeof(out));
+    if(!entries.empty()) {
+        file.write((const char *)entries.data(), entries.size()*sizeof(AdLibraryEntry));
+    }
+    file.write(names.data(), names.size());
+    std::vector<char> padding(out.framesOffset - (out.namesOffset + names.size()), 0);
+    file.write(padding.data(), padding.size());
+    if(!frameData.empty()) {
+        file.write((const char *)frameData.data(), frameData.size());
+    }
+    file.close();
+    if(!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write ad library " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
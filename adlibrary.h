@@ -0,0 +1,107 @@
+// Binary ad library: every ad's sampled descriptor frames in one file that gets mmap'd and used in place.
+#ifndef RETRIEVALT1_ADLIBRARY_H
+#define RETRIEVALT1_ADLIBRARY_H
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// File layout (native endianness, everything 8-byte aligned, the frame block 64-byte aligned):
+//   AdLibraryHeader
+//   AdLibraryEntry[adCount]
+//   names block (the ad names back to back, not null terminated)
+//   frame block: totalSampled frames of frameStride bytes each, row-major W*H uint8 pixels (+ zero padding)
+const char AD_LIBRARY_MAGIC[8] = {'A', 'D', 'L', 'I', 'B', 'R', 'R', 'Y'};
+const uint32_t AD_LIBRARY_VERSION = 2;
+const uint64_t AD_LIBRARY_FRAME_ALIGN = 64;
+
+struct AdLibraryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t frameW, frameH;
+    // Bytes between two consecutive frames in the frame block (W*H rounded up to a multiple of 32)
+    uint32_t frameStride;
+    uint32_t adCount;
+    // How the descriptors were made (a DescriptorBackend, see descriptor.h)
+    uint32_t descriptorBackend;
+    uint32_t reserved;
+    uint64_t totalSampled;
+    uint64_t namesOffset;
+    uint64_t framesOffset;
+    uint64_t fileSize;
+};
+
+// One row of the ad table.
+struct AdLibraryEntry {
+    uint64_t nameOffset;    // relative to the start of the names block
+    uint64_t nameLength;
+    uint64_t firstFrame;    // index (in frames, not bytes) of the ad's first sampled frame in the frame block
+    uint64_t sampledFrames;
+    uint64_t totalFrames;   // in the original video
+    double duration;        // ms
+};
+
+// Read-only view of a library file. The frames are never copied: frame(i) points straight into the mapping.
+class AdLibrary {
+public:
+    AdLibrary();
+    ~AdLibrary();
+    // Maps the file and checks its header. Returns false (and prints why) if it isn't a usable library.
+    bool open(const std::string &path);
+    void close();
+    bool isOpen() const {return base != nullptr;}
+
+    uint32_t adCount() const {return header->adCount;}
+    uint32_t sampleRate() const {return header->sampleRate;}
+    uint32_t frameW() const {return header->frameW;}
+    uint32_t frameH() const {return header->frameH;}
+    uint32_t frameSize() const {return header->frameW*header->frameH;}
+    uint32_t frameStride() const {return header->frameStride;}
+    uint32_t descriptorBackend() const {return header->descriptorBackend;}
+    uint64_t totalSampled() const {return header->totalSampled;}
+    const AdLibraryEntry &entry(uint32_t ad) const {return entries[ad];}
+    std::string name(uint32_t ad) const {return std::string(names + entries[ad].nameOffset, entries[ad].nameLength);}
+    // Start of the contiguous frame block (totalSampled()*frameStride() bytes)
+    const uint8_t *frames() const {return frameBlock;}
+    // Global frame index -> pixels
+    const uint8_t *frame(uint64_t index) const {return frameBlock + index*header->frameStride;}
+    // Frame 'adFrame' (0-indexed, relative to the ad's sampled frames) of the given ad
+    const uint8_t *adFrame(uint32_t ad, uint64_t adFrame) const {return frame(entries[ad].firstFrame + adFrame);}
+    // Which ad a global frame index belongs to
+    uint32_t adOfFrame(uint64_t index) const;
+    // Hash of the whole file, so things derived from the library (like its index) can tell if they're stale
+    uint64_t fingerprint() const;
+    size_t fileSize() const {return mappedSize;}
+
+private:
+    AdLibrary(const AdLibrary &) = delete;
+    AdLibrary &operator=(const AdLibrary &) = delete;
+    void *base;
+    size_t mappedSize;
+    const AdLibraryHeader *header;
+    const AdLibraryEntry *entries;
+    const char *names;
+    const uint8_t *frameBlock;
+};
+
+// Collects ads in memory and writes them out as a library file.
+class AdLibraryBuilder {
+public:
+    AdLibraryBuilder(uint32_t sampleRate, uint32_t frameW, uint32_t frameH, uint32_t descriptorBackend);
+    // 'frames' holds sampledFrames descriptors of frameW*frameH bytes each, sourceStride bytes apart
+    // (0 means packed back to back, anything else is e.g. for copying straight out of another library).
+    void addAd(const std::string &name, uint64_t totalFrames, double duration,
+               const uint8_t *frames, uint64_t sampledFrames, uint64_t sourceStride = 0);
+    uint32_t adCount() const {return (uint32_t)entries.size();}
+    // Writes to path + ".tmp" and renames over path, so readers never see half a library.
+    bool write(const std::string &path) const;
+
+private:
+    AdLibraryHeader header;
+    std::vector<AdLibraryEntry> entries;
+    std::string names;
+    std::vector<uint8_t> frameData;
+};
+
+#endif //RETRIEVALT1_ADLIBRARY_H
@@ -0,0 +1,133 @@
+#include "batched.h"
+#include <algorithm>
+#include <climits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Dot products of 4 queries (widened to int16, 'queryStride' apart) with one library frame. 'length' is the frame
+// stride, a multiple of 32, and both sides are zero past the real frame size so the padding adds nothing.
+typedef void (*Dot4Func)(const int16_t *queries, size_t queryStride, const uint8_t *frame, int length, int32_t *dots);
+
+static void dot4Scalar(const int16_t *queries, size_t queryStride, const uint8_t *frame, int length, int32_t *dots) {
+    int32_t acc[4] = {0, 0, 0, 0};
+    for(int i = 0; i < length; i++) {
+        int32_t px = frame[i];
+        for(int q = 0; q < 4; q++) {acc[q] += queries[q*queryStride + i]*px;}
+    }
+    for(int q = 0; q < 4; q++) {dots[q] = acc[q];}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 frame pixels get widened once and madd'd against each of the 4 queries (pairs of 16 bit products added into
+// 32 bit lanes). At most 255*255*2 per lane per step, so lanes don't overflow for any descriptor squaredL2 allows.
+__attribute__((target("avx2")))
+static void dot4AVX2(const int16_t *queries, size_t queryStride, const uint8_t *frame, int length, int32_t *dots) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+    const int16_t *q0 = queries, *q1 = queries + queryStride, *q2 = q1 + queryStride, *q3 = q2 + queryStride;
+    for(int i = 0; i < length; i += 16) {
+        __m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(frame + i)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(px, _mm256_loadu_si256((const __m256i *)(q0 + i))));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(px, _mm256_loadu_si256((const __m256i *)(q1 + i))));
+        acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(px, _mm256_loadu_si256((const __m256i *)(q2 + i))));
+        acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(px, _mm256_loadu_si256((const __m256i *)(q3 + i))));
+    }
+    // Horizontal sums of all four at once: hadd pairs them up, then the two 128 bit halves get added
+    __m256i sums = _mm256_hadd_epi32(_mm256_hadd_epi32(acc0, acc1), _mm256_hadd_epi32(acc2, acc3));
+    __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    _mm_storeu_si128((__m128i *)dots, total);
+}
+#endif
+
+struct Dot4Choice {
+    Dot4Func func;
+    const char *name;
+};
+
+static Dot4Choice chooseDot4() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {return {dot4AVX2, "avx2"};}
+#endif
+    return {dot4Scalar, "scalar"};
+}
+
+// Picked once, same as squaredL2's
+static const Dot4Choice &dot4Choice() {
+    static const Dot4Choice choice = chooseDot4();
+    return choice;
+}
+
+const char *batchedKernel() {
+    return dot4Choice().name;
+}
+
+const unsigned long BatchedSearch::QUERY_BLOCK;
+const unsigned long BatchedSearch::TILE_BYTES;
+
+BatchedSearch::BatchedSearch() : tileFrames(1) {}
+
+void BatchedSearch::build(const AdLibrary &library) {
+    uint64_t total = library.totalSampled();
+    int frameSize = (int)library.frameSize();
+    norms.resize(total);
+    for(uint64_t i = 0; i < total; i++) {
+        const uint8_t *frame = library.frame(i);
+        int64_t norm = 0;
+        for(int px = 0; px < frameSize; px++) {norm += (int64_t)frame[px]*frame[px];}
+        norms[i] = norm;
+    }
+    tileFrames = std::max<unsigned long>(16, TILE_BYTES/library.frameStride());
+}
+
+void BatchedSearch::nearest(const AdLibrary &library, const uint8_t *queries, unsigned long count,
+                            size_t queryStride, uint64_t *indices, long *dists) const {
+    Dot4Func dot4 = dot4Choice().func;
+    int frameSize = (int)library.frameSize();
+    int length = (int)library.frameStride();
+    uint64_t total = library.totalSampled();
+    // The block's queries widened to int16 and zero padded to the library's stride, in rows rounded up to a
+    // multiple of 4 (the extra rows are zeroes whose results get ignored)
+    unsigned long maxBlock = std::min(QUERY_BLOCK, count);
+    std::vector<int16_t> block(((maxBlock + 3)/4)*4*length);
+    std::vector<int64_t> queryNorms(maxBlock);
+    int32_t dots[4];
+    for(unsigned long blockStart = 0; blockStart < count; blockStart += QUERY_BLOCK) {
+        unsigned long blockSize = std::min(QUERY_BLOCK, count - blockStart);
+        unsigned long groups = (blockSize + 3)/4;
+        std::fill(block.begin(), block.end(), 0);
+        for(unsigned long q = 0; q < blockSize; q++) {
+            const uint8_t *query = queries + (blockStart + q)*queryStride;
+            int16_t *row = &block[q*length];
+            int64_t norm = 0;
+            for(int px = 0; px < frameSize; px++) {
+                row[px] = query[px];
+                norm += (int64_t)query[px]*query[px];
+            }
+            queryNorms[q] = norm;
+            indices[blockStart + q] = 0;
+            dists[blockStart + q] = LONG_MAX;
+        }
+        // Tiles in library order, and frames in order within them, with only strictly better ones replacing the
+        // best: same tie breaking as the plain scan
+        for(uint64_t tileStart = 0; tileStart < total; tileStart += tileFrames) {
+            uint64_t tileEnd = std::min<uint64_t>(total, tileStart + tileFrames);
+            for(unsigned long group = 0; group < groups; group++) {
+                const int16_t *groupQueries = &block[group*4*length];
+                unsigned long groupSize = std::min<unsigned long>(4, blockSize - group*4);
+                for(uint64_t i = tileStart; i < tileEnd; i++) {
+                    dot4(groupQueries, (size_t)length, library.frame(i), length, dots);
+                    for(unsigned long q = 0; q < groupSize; q++) {
+                        unsigned long query = group*4 + q;
+                        long dist = (long)(queryNorms[query] + norms[i] - 2*(int64_t)dots[q]);
+                        if(dist < dists[blockStart + query]) {
+                            dists[blockStart + query] = dist;
+                            indices[blockStart + query] = i;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
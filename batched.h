@@ -0,0 +1,37 @@
+// Exhaustive nearest-frame search for blocks of queries at a time, done like a matrix product.
+#ifndef RETRIEVALT1_BATCHED_H
+#define RETRIEVALT1_BATCHED_H
+#include "adlibrary.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Same answers as the plain exhaustive scan (ties included), but the distances come from
+//     ||a-b||^2 = ||a||^2 + ||b||^2 - 2 a.b
+// with the library frames' squared norms worked out once in build(). The dot products are done for a block of
+// queries against a tile of library frames at a time, small enough for the tile to stay in L2 while every query
+// of the block goes through it (and a group of 4 queries at a time to share each library frame load), instead of
+// streaming the whole library through the cache once per query. Everything is integer, so it's exact.
+class BatchedSearch {
+public:
+    // Queries per block, and how many bytes of library frames a tile should take
+    static const unsigned long QUERY_BLOCK = 64;
+    static const unsigned long TILE_BYTES = 128*1024;
+
+    BatchedSearch();
+    void build(const AdLibrary &library);
+    bool empty() const {return norms.empty();}
+    // Nearest library frame (global index) and its distance for each of 'count' queries, which are 'queryStride'
+    // bytes apart (each library.frameSize() pixels long). Safe to call from many threads at once.
+    void nearest(const AdLibrary &library, const uint8_t *queries, unsigned long count, size_t queryStride,
+                 uint64_t *indices, long *dists) const;
+
+private:
+    std::vector<int64_t> norms;     // squared norm of every library frame
+    unsigned long tileFrames;
+};
+
+// Name of the dot product kernel BatchedSearch ended up using ("avx2" or "scalar")
+const char *batchedKernel();
+
+#endif //RETRIEVALT1_BATCHED_H
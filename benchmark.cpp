@@ -0,0 +1,521 @@
+// Benchmark: makes a synthetic long video with ads inserted at known places, runs every stage of the pipeline on
+// it, checks the detections against where the ads really are, and writes the timings as JSON.
+// Usage: retrievalT1_bench [--work dir] [--out results.json] [--ads N] [--adSeconds S] [--videoMinutes M]
+//                          [--insertions N] [--fps F] [--width W] [--height H] [--threads T]
+// Everything is generated from fixed seeds, so two runs with the same arguments time the same work.
+#include "pipeline.h"
+#include "manifest.h"
+#include "shard.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+using namespace cv;
+
+struct BenchSettings {
+    String workFolder = "bench-data";
+    String outPath = "bench-results.json";
+    int ads = 20;
+    double adSeconds = 20;
+    double videoMinutes = 10;
+    int insertions = 30;
+    double fps = 30;
+    int width = 320, height = 240;
+    // For the decoding and search stages that can use more than one (0 = one per core)
+    int threads = 1;
+};
+
+// One ad put into the long video
+struct Insertion {
+    int ad;
+    unsigned long firstFrame;
+};
+
+// Wall clock time in seconds since 'start'
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static const char *modeName(SearchMode mode) {
+    switch(mode) {
+        case SEARCH_VP_TREE: return "vp_tree";
+        case SEARCH_PRUNED: return "pruned";
+        case SEARCH_BATCHED: return "batched";
+        case SEARCH_COMPACT: return "compact";
+        case SEARCH_GUIDED: return "guided";
+        default: return "brute_force";
+    }
+}
+
+static String adName(int ad) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "ad-%03d", ad);
+    return name;
+}
+
+// Frame 'f' of a synthetic clip. A clip is a run of 1.5 second "scenes", each one a coloured background with a few
+// rectangles and a slowly drifting circle, so neighbouring frames look alike (as in a real video) and scene cuts
+// don't. Clips with different seeds share nothing, so ads can't be mistaken for each other or for the filler.
+static Mat syntheticFrame(unsigned long long seed, unsigned long f, double fps, Size size) {
+    unsigned long sceneLength = (unsigned long)(fps*1.5);
+    unsigned long scene = f/sceneLength, t = f%sceneLength;
+    RNG rng(seed*1000003ULL + scene);
+    Mat frame(size, CV_8UC3);
+    frame.setTo(Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)));
+    for(int i = 0; i < 5; i++) {
+        int x = rng.uniform(0, size.width), y = rng.uniform(0, size.height);
+        int w = rng.uniform(size.width/8, size.width/2), h = rng.uniform(size.height/8, size.height/2);
+        rectangle(frame, Rect(x, y, w, h), Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), -1);
+    }
+    int cx = rng.uniform(0, size.width), cy = rng.uniform(0, size.height);
+    int radius = rng.uniform(size.height/10, size.height/4);
+    circle(frame, Point(cx + (int)t, cy + (int)t/2), radius,
+           Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), -1);
+    return frame;
+}
+
+// MJPG (every frame a keyframe) unless another fourcc is given
+static bool openWriter(VideoWriter &writer, const String &path, const BenchSettings &settings,
+        int fourcc = VideoWriter::fourcc('M', 'J', 'P', 'G')) {
+    writer = VideoWriter(path, fourcc, settings.fps, Size(settings.width, settings.height));
+    if(!writer.isOpened()) {std::cerr << "ERROR: Couldn't create " << path << std::endl;}
+    return writer.isOpened();
+}
+
+// Writes the ads into adsFolder and the long video into videoPath. Insertions are spread evenly over the video
+// (cycling through the ads), with filler from other seeds in between. The same long video also goes into gopVideoPath
+// as MPEG-4 with keyframes only every so often, where seeking to a frame isn't exact. Returns false if something
+// couldn't be written.
+static bool generateVideos(const BenchSettings &settings, const String &adsFolder, const String &videoPath,
+        const String &gopVideoPath, std::vector<Insertion> &insertions) {
+    Size size(settings.width, settings.height);
+    unsigned long adFrames = (unsigned long)(settings.adSeconds*settings.fps);
+    for(int ad = 0; ad < settings.ads; ad++) {
+        VideoWriter writer;
+        if(!openWriter(writer, adsFolder + "/" + adName(ad) + ".avi", settings)) {return false;}
+        for(unsigned long f = 0; f < adFrames; f++) {writer.write(syntheticFrame(ad + 1, f, settings.fps, size));}
+        writer.release();
+    }
+    unsigned long totalFrames = (unsigned long)(settings.videoMinutes*60*settings.fps);
+    unsigned long adTotal = adFrames*settings.insertions;
+    if(adTotal > totalFrames) {
+        std::cerr << "ERROR: " << settings.insertions << " insertions don't fit in the video" << std::endl;
+        return false;
+    }
+    // Filler gaps between (and around) the insertions
+    unsigned long gap = (totalFrames - adTotal)/(settings.insertions + 1);
+    VideoWriter writer, gopWriter;
+    if(!openWriter(writer, videoPath, settings) ||
+       !openWriter(gopWriter, gopVideoPath, settings, VideoWriter::fourcc('m', 'p', '4', 'v'))) {return false;}
+    insertions.clear();
+    unsigned long frame = 0;
+    unsigned long long fillerSeed = 1000000;
+    for(int i = 0; i <= settings.insertions; i++) {
+        unsigned long fillerEnd = (i == settings.insertions) ? totalFrames : frame + gap;
+        for(unsigned long f = 0; frame < fillerEnd; f++, frame++) {
+            Mat filler = syntheticFrame(fillerSeed + i, f, settings.fps, size);
+            writer.write(filler);
+            gopWriter.write(filler);
+        }
+        if(i == settings.insertions) {break;}
+        Insertion insertion;
+        insertion.ad = i%settings.ads;
+        insertion.firstFrame = frame;
+        insertions.push_back(insertion);
+        for(unsigned long f = 0; f < adFrames; f++, frame++) {
+            Mat adFrame = syntheticFrame(insertion.ad + 1, f, settings.fps, size);
+            writer.write(adFrame);
+            gopWriter.write(adFrame);
+        }
+    }
+    writer.release();
+    gopWriter.release();
+    return true;
+}
+
+// One detection line of detectAds' output: video, start (s), duration (s), ad name
+struct ReportedDetection {
+    double start;
+    String ad;
+};
+
+static std::vector<ReportedDetection> readDetections(const String &path) {
+    std::vector<ReportedDetection> detections;
+    std::ifstream file(path);
+    std::string line;
+    while(std::getline(file, line)) {
+        std::stringstream fields(line);
+        std::string video, start, duration, ad;
+        std::getline(fields, video, '\t');
+        std::getline(fields, start, '\t');
+        std::getline(fields, duration, '\t');
+        std::getline(fields, ad);
+        if(ad.empty()) {continue;}
+        ReportedDetection detection;
+        detection.start = std::atof(start.c_str());
+        detection.ad = ad;
+        detections.push_back(detection);
+    }
+    return detections;
+}
+
+// Matches detections to insertions (same ad, start within 'tolerance' seconds), each insertion at most once.
+static void scoreDetections(const std::vector<ReportedDetection> &detections, const std::vector<Insertion> &insertions,
+        double fps, double tolerance, unsigned long &found, unsigned long &falsePositives) {
+    std::vector<char> used(insertions.size(), 0);
+    found = 0;
+    falsePositives = 0;
+    for(const ReportedDetection &detection: detections) {
+        bool matched = false;
+        for(unsigned long i = 0; i < insertions.size() && !matched; i++) {
+            double start = insertions[i].firstFrame/fps;
+            if(!used[i] && adName(insertions[i].ad) == detection.ad && std::abs(detection.start - start) <= tolerance) {
+                used[i] = 1;
+                matched = true;
+            }
+        }
+        if(matched) {found++;}
+        else {falsePositives++;}
+    }
+}
+
+// Minimal JSON writing: "key": value pairs, the caller handles the braces and commas.
+static String jsonString(const String &value) {
+    String res = "\"";
+    for(char c: value) {
+        if(c == '"' || c == '\\') {res += '\\';}
+        res += c;
+    }
+    return res + "\"";
+}
+
+static String jsonNumber(double value) {
+    std::ostringstream out;
+    out.precision(10);
+    out << value;
+    return out.str();
+}
+
+// Whether both files can be read and hold the very same bytes
+static bool sameFileContents(const String &pathA, const String &pathB) {
+    std::ifstream fileA(pathA), fileB(pathB);
+    if(!fileA || !fileB) {return false;}
+    std::stringstream textA, textB;
+    textA << fileA.rdbuf();
+    textB << fileB.rdbuf();
+    return textA.str() == textB.str();
+}
+
+// ns per squaredL2 call of one kernel, over every pair of (a slice of) the library's frames
+static double kernelNsPerDistance(long (*kernel)(const uchar *, const uchar *, int), const AdLibrary &library) {
+    unsigned long frames = std::min<unsigned long>(library.totalSampled(), 2000);
+    if(frames == 0) {return 0;}
+    volatile long sink = 0;
+    unsigned long calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    // Enough rounds to get past timer resolution
+    while(calls < 20000000UL) {
+        for(unsigned long i = 0; i < frames; i++) {
+            const uchar *query = library.frame(i);
+            for(unsigned long j = 0; j < frames; j++) {
+                sink = sink + kernel(query, library.frame(j), (int)library.frameSize());
+            }
+        }
+        calls += frames*frames;
+    }
+    return secondsSince(start)*1e9/calls;
+}
+
+static bool parseArguments(int argc, char **argv, BenchSettings &settings) {
+    for(int i = 1; i + 1 < argc; i += 2) {
+        String key = argv[i], value = argv[i + 1];
+        if(key == "--work") {settings.workFolder = value;}
+        else if(key == "--out") {settings.outPath = value;}
+        else if(key == "--ads") {settings.ads = std::atoi(value.c_str());}
+        else if(key == "--adSeconds") {settings.adSeconds = std::atof(value.c_str());}
+        else if(key == "--videoMinutes") {settings.videoMinutes = std::atof(value.c_str());}
+        else if(key == "--insertions") {settings.insertions = std::atoi(value.c_str());}
+        else if(key == "--fps") {settings.fps = std::atof(value.c_str());}
+        else if(key == "--width") {settings.width = std::atoi(value.c_str());}
+        else if(key == "--height") {settings.height = std::atoi(value.c_str());}
+        else if(key == "--threads") {settings.threads = std::atoi(value.c_str());}
+        else {
+            std::cerr << "ERROR: Unknown option " << key << std::endl;
+            return false;
+        }
+    }
+    if(argc%2 == 0) {
+        std::cerr << "ERROR: Option " << argv[argc - 1] << " has no value" << std::endl;
+        return false;
+    }
+    if(settings.ads <= 0 || settings.insertions <= 0 || settings.fps <= 0 || settings.adSeconds <= 0) {
+        std::cerr << "ERROR: --ads, --insertions, --fps and --adSeconds have to be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    // The sharded run below launches this same executable as its workers
+    int worker = shardWorkerMain(argc, argv);
+    if(worker >= 0) {return worker;}
+    BenchSettings settings;
+    if(!parseArguments(argc, argv, settings)) {return 1;}
+    String adsFolder = settings.workFolder + "/ads", textFolder = settings.workFolder + "/ad-descriptors";
+    String videoPath = settings.workFolder + "/long.avi", libraryPath = settings.workFolder + "/ads.adlib";
+    String gopVideoPath = settings.workFolder + "/long-gop.mp4";
+    String directoryPath = settings.workFolder + "/AdsDirectory";
+    String nearestPath = settings.workFolder + "/long.nearest", resultsPath = settings.workFolder + "/results.txt";
+    mkdir(settings.workFolder.c_str(), 0755);
+    mkdir(adsFolder.c_str(), 0755);
+    mkdir(textFolder.c_str(), 0755);
+
+    std::cout << "Generating " << settings.ads << " ads and a " << settings.videoMinutes << " minute video in "
+              << settings.workFolder << std::endl;
+    std::vector<Insertion> insertions;
+    auto start = std::chrono::steady_clock::now();
+    if(!generateVideos(settings, adsFolder, videoPath, gopVideoPath, insertions)) {return 1;}
+    double generateSeconds = secondsSince(start);
+
+    // Library (and its indexes) from scratch every time, so it's the full build that gets timed and not an
+    // incremental no-op, and every index gets built cold
+    std::remove(libraryPath.c_str());
+    std::remove(manifestPath(libraryPath).c_str());
+    std::remove(vpTreePath(libraryPath).c_str());
+    std::remove(compactIndexPath(libraryPath).c_str());
+    start = std::chrono::steady_clock::now();
+    if(makeVideoDescriptorFiles(adsFolder, "avi", libraryPath, directoryPath, false, textFolder,
+                                settings.threads) != 1) {return 1;}
+    double librarySeconds = secondsSince(start);
+
+    // The old text descriptors, read back the way the original pipeline did
+    std::vector<String> textPaths;
+    glob(textFolder + "/*.txt", textPaths, false);
+    unsigned long textFrames = 0;
+    start = std::chrono::steady_clock::now();
+    for(const String &path: textPaths) {textFrames += std::get<0>(readDescriptors(path)).size();}
+    double readDescriptorsSeconds = secondsSince(start);
+
+    AdLibrary library;
+    if(!openAdLibrary(library, libraryPath)) {return 1;}
+
+    start = std::chrono::steady_clock::now();
+    std::vector<Mat> videoDescriptors;
+    double totalFrames;
+    long double duration;
+    std::tie(videoDescriptors, totalFrames, duration) = videoToDescriptor(videoPath, false, settings.threads);
+    double decodeSeconds = secondsSince(start);
+    FrameMatrix videoFrames(videoDescriptors.size(), Config.resizeW*Config.resizeH);
+    for(unsigned long i = 0; i < videoDescriptors.size(); i++) {videoFrames.setRow(i, videoDescriptors[i]);}
+    std::vector<Mat>().swap(videoDescriptors);
+
+    // Range decoding on the GOP encoded copy has to give exactly what going front to back does. At least 4 ranges,
+    // however short the video is, so it always seeks.
+    std::vector<Mat> gopSerial, gopRanges;
+    double gopFrames;
+    long double gopDuration;
+    std::tie(gopSerial, gopFrames, gopDuration) = videoToDescriptor(gopVideoPath, false, 1);
+    start = std::chrono::steady_clock::now();
+    std::tie(gopRanges, gopFrames, gopDuration) = videoToDescriptor(gopVideoPath, false,
+            settings.threads == 1 ? 4 : settings.threads, Config.descriptorBackend, 1);
+    double gopDecodeSeconds = secondsSince(start);
+    bool gopRangesMatch = gopSerial.size() == gopRanges.size();
+    for(unsigned long i = 0; gopRangesMatch && i < gopSerial.size(); i++) {
+        gopRangesMatch = sameDescriptor(gopSerial[i], gopRanges[i]);
+    }
+    std::vector<Mat>().swap(gopSerial);
+    std::vector<Mat>().swap(gopRanges);
+    std::cout << "GOP range decoding: " << gopDecodeSeconds << " s, "
+              << (gopRangesMatch ? "same descriptors" : "DIFFERENT descriptors") << std::endl;
+    if(!gopRangesMatch) {std::cerr << "ERROR: Range decoding of " << gopVideoPath << " doesn't match" << std::endl;}
+
+    // Every search mode on the same frames. The exact ones have to agree with brute force frame for frame, the
+    // approximate ones just get their recall (same ad frame as brute force) reported.
+    struct ModeRun {
+        SearchMode mode;
+        bool exact;
+        double prepareSeconds, searchSeconds;
+        SearchStats stats;
+        double recall;
+        bool matchesBruteForce;
+    };
+    std::vector<ModeRun> runs = {{SEARCH_BRUTE_FORCE, true}, {SEARCH_PRUNED, true}, {SEARCH_VP_TREE, true},
+                                 {SEARCH_BATCHED, true}, {SEARCH_COMPACT, false}, {SEARCH_GUIDED, true}};
+    std::vector<FrameMatch> exactNearest;
+    for(ModeRun &run: runs) {
+        SearchOptions options = searchOptionsFromConfig();
+        options.mode = run.mode;
+        options.threads = settings.threads;
+        options.maxChecks = 0;
+        start = std::chrono::steady_clock::now();
+        NearestFrameSearcher searcher;
+        if(!searcher.prepare(library, libraryPath, options)) {return 1;}
+        run.prepareSeconds = secondsSince(start);
+        start = std::chrono::steady_clock::now();
+        std::vector<FrameMatch> nearest = searchNearestFrames(searcher, videoFrames, options, run.stats);
+        run.searchSeconds = secondsSince(start);
+        if(run.mode == SEARCH_BRUTE_FORCE) {exactNearest = nearest;}
+        unsigned long same = 0;
+        for(unsigned long i = 0; i < nearest.size(); i++) {
+            same += nearest[i].ad == exactNearest[i].ad && nearest[i].adFrame == exactNearest[i].adFrame;
+        }
+        run.matchesBruteForce = same == nearest.size();
+        run.recall = nearest.empty() ? 1 : (double)same/nearest.size();
+        std::cout << modeName(run.mode) << ": " << run.searchSeconds << " s, recall " << run.recall << ", ";
+        run.stats.print(std::cout);
+        if(run.exact && !run.matchesBruteForce) {
+            std::cerr << "ERROR: " << modeName(run.mode) << " doesn't match brute force" << std::endl;
+        }
+    }
+
+    // findNearestFrames as a whole (decode + search with Config's settings + writing the file), then detectAds on it
+    SearchOptions configOptions = searchOptionsFromConfig();
+    configOptions.threads = settings.threads;
+    start = std::chrono::steady_clock::now();
+    findNearestFrames(videoPath, nearestPath, libraryPath, false, configOptions);
+    double findNearestSeconds = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    if(detectAds(nearestPath, directoryPath, resultsPath) != 1) {return 1;}
+    double detectSeconds = secondsSince(start);
+
+    std::vector<ReportedDetection> detections = readDetections(resultsPath);
+    // A detection's start can be off by the matcher's start margin (in sampled frames), plus one sampling step
+    double tolerance = (Config.matchStartErrorMargin + 1)*Config.sampleRate/settings.fps;
+    unsigned long found, falsePositives;
+    scoreDetections(detections, insertions, settings.fps, tolerance, found, falsePositives);
+    std::cout << "Detections: " << found << " of " << insertions.size() << " insertions found, "
+              << falsePositives << " false positives" << std::endl;
+
+    // The same detection through Config.shardCount worker processes, which has to give the very same results file
+    String shardedResultsPath = settings.workFolder + "/results-sharded.txt";
+    ShardMergeStats shardStats;
+    start = std::chrono::steady_clock::now();
+    bool shardedOk = shardedDetectAds(videoPath, libraryPath, directoryPath, shardedResultsPath, settings.workFolder,
+                                      selfExecutablePath(), false, &shardStats) == 1;
+    double shardedSeconds = secondsSince(start);
+    bool shardedMatches = shardedOk && sameFileContents(resultsPath, shardedResultsPath);
+    std::cout << "Sharded: " << shardedSeconds << " s, " << shardStats.shards << " shards, " << shardStats.reruns
+              << " tracked again, " << (shardedMatches ? "same results" : "DIFFERENT results") << std::endl;
+    if(!shardedMatches) {std::cerr << "ERROR: Sharded results don't match the single process ones" << std::endl;}
+    // And on the GOP encoded copy, where the workers' seeks can land off
+    String gopNearestPath = settings.workFolder + "/long-gop.nearest";
+    String gopResultsPath = settings.workFolder + "/results-gop.txt";
+    String gopShardedResultsPath = settings.workFolder + "/results-gop-sharded.txt";
+    findNearestFrames(gopVideoPath, gopNearestPath, libraryPath, false, configOptions);
+    ShardMergeStats gopShardStats;
+    bool gopShardedMatches = detectAds(gopNearestPath, directoryPath, gopResultsPath) == 1 &&
+                             shardedDetectAds(gopVideoPath, libraryPath, directoryPath, gopShardedResultsPath,
+                                              settings.workFolder, selfExecutablePath(), false, &gopShardStats) == 1 &&
+                             sameFileContents(gopResultsPath, gopShardedResultsPath);
+    std::cout << "Sharded GOP: " << gopShardStats.reseeks << " shards decoded again, "
+              << (gopShardedMatches ? "same results" : "DIFFERENT results") << std::endl;
+    if(!gopShardedMatches) {std::cerr << "ERROR: Sharded GOP results don't match the single process ones" << std::endl;}
+
+    // The luma backend against the original one, on the long video
+    DescriptorParity parity;
+    bool haveParity = compareDescriptorBackends(videoPath, DESCRIPTOR_BGR_CUBIC, DESCRIPTOR_LUMA_AREA, parity,
+                                                settings.threads);
+
+    struct KernelRun {
+        const char *name;
+        long (*kernel)(const uchar *, const uchar *, int);
+    };
+    std::vector<KernelRun> kernels = {{"scalar", squaredL2Scalar}, {"sse2", squaredL2SSE2}, {"avx2", squaredL2AVX2},
+                                      {"fixed", squaredL2For((int)library.frameSize())}};
+    String dispatched = squaredL2Kernel();
+
+    std::ofstream out(settings.outPath);
+    out << "{\n";
+    out << "  \"settings\": {\"ads\": " << settings.ads << ", \"adSeconds\": " << jsonNumber(settings.adSeconds)
+        << ", \"videoMinutes\": " << jsonNumber(settings.videoMinutes) << ", \"insertions\": " << settings.insertions
+        << ", \"fps\": " << jsonNumber(settings.fps) << ", \"width\": " << settings.width
+        << ", \"height\": " << settings.height << ", \"threads\": " << settings.threads
+        << ", \"sampleRate\": " << Config.sampleRate << ", \"resizeW\": " << Config.resizeW
+        << ", \"resizeH\": " << Config.resizeH
+        << ", \"descriptorBackend\": " << jsonString(descriptorBackendName(Config.descriptorBackend))
+        << ", \"libraryFrames\": " << library.totalSampled()
+        << ", \"videoFrames\": " << jsonNumber(totalFrames) << ", \"videoSampled\": " << videoFrames.rows() << "},\n";
+    out << "  \"generateSeconds\": " << jsonNumber(generateSeconds) << ",\n";
+    out << "  \"stages\": {\n";
+    out << "    \"buildLibrary\": {\"seconds\": " << jsonNumber(librarySeconds) << "},\n";
+    out << "    \"readDescriptors\": {\"seconds\": " << jsonNumber(readDescriptorsSeconds)
+        << ", \"files\": " << textPaths.size() << ", \"framesPerSecond\": "
+        << jsonNumber(readDescriptorsSeconds > 0 ? textFrames/readDescriptorsSeconds : 0) << "},\n";
+    out << "    \"videoToDescriptor\": {\"seconds\": " << jsonNumber(decodeSeconds) << ", \"framesPerSecond\": "
+        << jsonNumber(decodeSeconds > 0 ? totalFrames/decodeSeconds : 0) << ", \"gopRangesSeconds\": "
+        << jsonNumber(gopDecodeSeconds) << ", \"gopRangesMatchSerial\": " << (gopRangesMatch ? "true" : "false")
+        << "},\n";
+    out << "    \"findNearestFrames\": {\"seconds\": " << jsonNumber(findNearestSeconds)
+        << ", \"mode\": " << jsonString(modeName(configOptions.mode))
+        << ", \"framesPerSecond\": " << jsonNumber(findNearestSeconds > 0 ? totalFrames/findNearestSeconds : 0)
+        << "},\n";
+    out << "    \"detectAds\": {\"seconds\": " << jsonNumber(detectSeconds) << ", \"sampledFramesPerSecond\": "
+        << jsonNumber(detectSeconds > 0 ? videoFrames.rows()/detectSeconds : 0) << "}\n";
+    out << "  },\n";
+    out << "  \"search\": [\n";
+    for(unsigned long i = 0; i < runs.size(); i++) {
+        const ModeRun &run = runs[i];
+        out << "    {\"mode\": " << jsonString(modeName(run.mode))
+            << ", \"prepareSeconds\": " << jsonNumber(run.prepareSeconds)
+            << ", \"seconds\": " << jsonNumber(run.searchSeconds) << ", \"sampledFramesPerSecond\": "
+            << jsonNumber(run.searchSeconds > 0 ? run.stats.queries/run.searchSeconds : 0)
+            << ", \"distances\": " << run.stats.distances << ", \"candidates\": " << run.stats.candidates
+            << ", \"guided\": " << run.stats.guided << ", \"guessesConfirmed\": " << run.stats.guessesConfirmed
+            << ", \"nsPerDistance\": "
+            << jsonNumber(run.stats.distances > 0 ? run.searchSeconds*1e9/run.stats.distances : 0)
+            << ", \"exact\": " << (run.exact ? "true" : "false") << ", \"recall\": " << jsonNumber(run.recall)
+            << ", \"matchesBruteForce\": " << (run.matchesBruteForce ? "true" : "false") << "}"
+            << (i + 1 < runs.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n";
+    out << "  \"kernels\": {\"dispatched\": " << jsonString(dispatched)
+        << ", \"batchedDispatched\": " << jsonString(batchedKernel())
+        << ", \"fixedDispatched\": " << jsonString(squaredL2KernelFor((int)library.frameSize()));
+    for(const KernelRun &kernel: kernels) {
+        // Only the ones the CPU can actually run
+        if(String(kernel.name) == "avx2" && dispatched != "avx2") {continue;}
+        if(String(kernel.name) == "sse2" && dispatched == "scalar") {continue;}
+        out << ", \"" << kernel.name << "NsPerDistance\": " << jsonNumber(kernelNsPerDistance(kernel.kernel, library));
+    }
+    out << "},\n";
+    if(haveParity) {
+        out << "  \"descriptorParity\": {\"reference\": " << jsonString(descriptorBackendName(parity.reference))
+            << ", \"candidate\": " << jsonString(descriptorBackendName(parity.candidate))
+            << ", \"referenceFramesPerSecond\": "
+            << jsonNumber(parity.referenceSeconds > 0 ? totalFrames/parity.referenceSeconds : 0)
+            << ", \"candidateFramesPerSecond\": "
+            << jsonNumber(parity.candidateSeconds > 0 ? totalFrames/parity.candidateSeconds : 0)
+            << ", \"meanAbsDiff\": " << jsonNumber(parity.meanAbsDiff) << ", \"maxAbsDiff\": " << parity.maxAbsDiff
+            << ", \"pixelsOver8\": " << jsonNumber(parity.pixelsOver8)
+            << ", \"meanFrameDistance\": " << jsonNumber(parity.meanFrameDistance) << "},\n";
+    }
+    out << "  \"detection\": {\"insertions\": " << insertions.size() << ", \"found\": " << found
+        << ", \"falsePositives\": " << falsePositives << ", \"toleranceSeconds\": " << jsonNumber(tolerance)
+        << "},\n";
+    out << "  \"sharded\": {\"shards\": " << shardStats.shards << ", \"overlap\": " << Config.shardOverlap
+        << ", \"reruns\": " << shardStats.reruns << ", \"seconds\": " << jsonNumber(shardedSeconds)
+        << ", \"singleProcessSeconds\": " << jsonNumber(findNearestSeconds + detectSeconds)
+        << ", \"matchesSingleProcess\": " << (shardedMatches ? "true" : "false")
+        << ", \"gopReseeks\": " << gopShardStats.reseeks
+        << ", \"gopMatchesSingleProcess\": " << (gopShardedMatches ? "true" : "false") << "}\n";
+    out << "}\n";
+    out.close();
+    std::cout << "Results saved in:\n\t" << settings.outPath << std::endl;
+    // The pipeline's own per-stage counters for everything above (the kernel micro benchmark isn't a stage)
+    String runReportPath = settings.workFolder + "/run-report.json";
+    if(instruments().writeReport(runReportPath)) {
+        std::cout << "Run report saved in:\n\t" << runReportPath << std::endl;
+    }
+
+    bool allExact = true;
+    for(const ModeRun &run: runs) {allExact = allExact && (!run.exact || run.matchesBruteForce);}
+    // Non-zero exit if the answers are wrong, so a regression run can't pass on speed alone
+    return (allExact && gopRangesMatch && shardedMatches && gopShardedMatches && found == insertions.size() &&
+            falsePositives == 0) ? 0 : 2;
+}
@@ -0,0 +1,230 @@
+#include "compact.h"
+#include "utils.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Header of a saved compact index, followed by the mean, the components and the codes
+struct CompactIndexFileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t dims;
+    int32_t frameSize;
+    int32_t codeStride;
+    uint64_t libraryFingerprint;
+    uint64_t libraryFrames;
+    float scale;
+    int32_t requestedDims;
+};
+
+// Squared euclidean distance between two int8 codes of 'length' bytes (a multiple of 32)
+typedef int32_t (*CodeDistFunc)(const int8_t *a, const int8_t *b, int length);
+
+static int32_t codeDistScalar(const int8_t *a, const int8_t *b, int length) {
+    int32_t res = 0;
+    for(int i = 0; i < length; i++) {
+        int32_t diff = (int32_t)a[i] - b[i];
+        res += diff*diff;
+    }
+    return res;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Widened to 16 bits before subtracting (int8 differences can overflow), then madd'd with themselves
+__attribute__((target("avx2")))
+static int32_t codeDistAVX2(const int8_t *a, const int8_t *b, int length) {
+    __m256i acc = _mm256_setzero_si256();
+    for(int i = 0; i < length; i += 16) {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+        __m256i diff = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    int32_t res = 0;
+    for(int lane = 0; lane < 8; lane++) {res += lanes[lane];}
+    return res;
+}
+#endif
+
+static CodeDistFunc chooseCodeDist() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {return codeDistAVX2;}
+#endif
+    return codeDistScalar;
+}
+
+static CodeDistFunc codeDist() {
+    static const CodeDistFunc func = chooseCodeDist();
+    return func;
+}
+
+const uint64_t CompactIndex::MAX_TRAINING_FRAMES;
+
+std::string compactIndexPath(const std::string &libraryPath) {
+    return libraryPath + ".pca";
+}
+
+CompactIndex::CompactIndex() : nDims(0), nRequestedDims(0), frameSize(0), nCodeStride(0), scale(1) {}
+
+void CompactIndex::encode(const uint8_t *frame, int8_t *code) const {
+    std::memset(code, 0, nCodeStride);
+    for(int d = 0; d < nDims; d++) {
+        const float *component = &components[(size_t)d*frameSize];
+        float projection = 0;
+        for(int px = 0; px < frameSize; px++) {projection += (frame[px] - mean[px])*component[px];}
+        long quantized = std::lround(projection/scale);
+        code[d] = (int8_t)std::max(-127L, std::min(127L, quantized));
+    }
+}
+
+void CompactIndex::build(const AdLibrary &library, int dims) {
+    frameSize = (int)library.frameSize();
+    uint64_t total = library.totalSampled();
+    nRequestedDims = dims;
+    nDims = std::max(1, std::min(dims, frameSize));
+    nCodeStride = ((nDims + 31)/32)*32;
+    codes.clear();
+    if(total == 0) {return;}
+    // Learn the components from (at most MAX_TRAINING_FRAMES of) the library's own frames
+    uint64_t training = std::min(total, MAX_TRAINING_FRAMES);
+    cv::Mat data((int)training, frameSize, CV_32F);
+    for(uint64_t row = 0; row < training; row++) {
+        const uint8_t *frame = library.frame(row*total/training);
+        float *out = data.ptr<float>((int)row);
+        for(int px = 0; px < frameSize; px++) {out[px] = frame[px];}
+    }
+    nDims = std::min(nDims, (int)training);
+    cv::PCA pca(data, cv::Mat(), cv::PCA::DATA_AS_ROW, nDims);
+    mean.assign(pca.mean.ptr<float>(0), pca.mean.ptr<float>(0) + frameSize);
+    components.resize((size_t)nDims*frameSize);
+    for(int d = 0; d < nDims; d++) {
+        std::memcpy(&components[(size_t)d*frameSize], pca.eigenvectors.ptr<float>(d), frameSize*sizeof(float));
+    }
+    // One scale for every dimension: the largest projection (usually on the first component) maps to 127
+    float largest = 0;
+    for(uint64_t row = 0; row < training; row++) {
+        const uint8_t *frame = library.frame(row*total/training);
+        for(int d = 0; d < nDims; d++) {
+            const float *component = &components[(size_t)d*frameSize];
+            float projection = 0;
+            for(int px = 0; px < frameSize; px++) {projection += (frame[px] - mean[px])*component[px];}
+            largest = std::max(largest, std::fabs(projection));
+        }
+    }
+    scale = largest > 0 ? largest/127.0f : 1.0f;
+    codes.resize(total*nCodeStride);
+    for(uint64_t i = 0; i < total; i++) {encode(library.frame(i), &codes[i*nCodeStride]);}
+}
+
+uint64_t CompactIndex::nearest(const AdLibrary &library, const uint8_t *query, unsigned long shortlist, long &dist,
+                               unsigned long *checks) const {
+    uint64_t total = library.totalSampled();
+    std::vector<int8_t> queryCode(nCodeStride);
+    encode(query, queryCode.data());
+    // The 'shortlist' nearest codes, as a max heap on (code distance, index) so the worst one is on top
+    shortlist = std::max(1UL, (unsigned long)std::min<uint64_t>(shortlist, total));
+    std::vector<std::pair<int32_t, uint64_t>> heap;
+    heap.reserve(shortlist);
+    CodeDistFunc func = codeDist();
+    for(uint64_t i = 0; i < total; i++) {
+        std::pair<int32_t, uint64_t> candidate(func(queryCode.data(), &codes[i*nCodeStride], nCodeStride), i);
+        if(heap.size() < shortlist) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else if(candidate < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+    // Exact re-rank, ties going to the smallest index like everywhere else
+    uint64_t best = 0;
+    dist = -1;
+    int size = (int)library.frameSize();
+    SquaredL2Func distance = squaredL2For(size);
+    for(const std::pair<int32_t, uint64_t> &candidate: heap) {
+        long candidateDist = distance(query, library.frame(candidate.second), size);
+        if(dist < 0 || candidateDist < dist || (candidateDist == dist && candidate.second < best)) {
+            dist = candidateDist;
+            best = candidate.second;
+        }
+    }
+    if(checks != nullptr) {*checks = heap.size();}
+    return best;
+}
+
+bool CompactIndex::save(const std::string &path, const AdLibrary &library) const {
+    CompactIndexFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, COMPACT_INDEX_MAGIC, sizeof(COMPACT_INDEX_MAGIC));
+    header.version = COMPACT_INDEX_VERSION;
+    header.dims = nDims;
+    header.frameSize = frameSize;
+    header.codeStride = nCodeStride;
+    header.libraryFingerprint = library.fingerprint();
+    header.libraryFrames = library.totalSampled();
+    header.scale = scale;
+    header.requestedDims = nRequestedDims;
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    if(!mean.empty()) {file.write((const char *)mean.data(), mean.size()*sizeof(float));}
+    if(!components.empty()) {file.write((const char *)components.data(), components.size()*sizeof(float));}
+    if(!codes.empty()) {file.write((const char *)codes.data(), codes.size());}
+    file.close();
+    if(!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write compact index " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CompactIndex::load(const std::string &path, const AdLibrary &library) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) {return false;}
+    CompactIndexFileHeader header;
+    file.read((char *)&header, sizeof(header));
+    if(!file || std::memcmp(header.magic, COMPACT_INDEX_MAGIC, sizeof(COMPACT_INDEX_MAGIC)) != 0 ||
+       header.version != COMPACT_INDEX_VERSION || header.libraryFrames != library.totalSampled() ||
+       header.frameSize != (int32_t)library.frameSize() || header.libraryFingerprint != library.fingerprint()) {
+        return false;
+    }
+    // The sizes have to add up to the file's before anything gets allocated from them
+    int64_t frames = (int64_t)header.libraryFrames;
+    if(header.dims < 1 || header.dims > header.frameSize || header.codeStride != ((header.dims + 31)/32)*32) {
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    int64_t expected = (int64_t)sizeof(header) + (int64_t)(header.dims + 1)*header.frameSize*(int64_t)sizeof(float) +
+                       frames*header.codeStride;
+    if((int64_t)file.tellg() != expected) {return false;}
+    file.seekg(sizeof(header));
+    nDims = header.dims;
+    nRequestedDims = header.requestedDims;
+    frameSize = header.frameSize;
+    nCodeStride = header.codeStride;
+    scale = header.scale;
+    mean.resize(frameSize);
+    components.resize((size_t)nDims*frameSize);
+    codes.resize(header.libraryFrames*nCodeStride);
+    file.read((char *)mean.data(), mean.size()*sizeof(float));
+    if(!components.empty()) {file.read((char *)components.data(), components.size()*sizeof(float));}
+    if(!codes.empty()) {file.read((char *)codes.data(), codes.size());}
+    if(!file) {
+        codes.clear();
+        return false;
+    }
+    return true;
+}
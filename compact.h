@@ -0,0 +1,55 @@
+// Compact (PCA + int8) copies of the ad library's frames, for finding a short list of candidates cheaply.
+#ifndef RETRIEVALT1_COMPACT_H
+#define RETRIEVALT1_COMPACT_H
+#include "adlibrary.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+const char COMPACT_INDEX_MAGIC[8] = {'A', 'D', 'P', 'C', 'A', 'I', 'D', 'X'};
+const uint32_t COMPACT_INDEX_VERSION = 2;
+
+// Every library frame projected onto the first 'dims' principal components of the library (learnt from its own
+// frames) and quantized to int8 with one scale for all dimensions, so that distances between codes are still
+// (scaled) euclidean distances in the PCA space. A query is projected the same way, the codes are scanned for the
+// 'shortlist' nearest ones, and those get re-ranked with their exact distance. That's approximate: the true nearest
+// frame can miss the short list (recall is the thing to measure, see compactRecallReport), but what's returned
+// always comes with its exact distance.
+class CompactIndex {
+public:
+    // Most frames the PCA is learnt from (evenly spaced over the library)
+    static const uint64_t MAX_TRAINING_FRAMES = 20000;
+
+    CompactIndex();
+    void build(const AdLibrary &library, int dims);
+    // Same as the VP tree's: the file remembers the library's fingerprint and load() refuses a stale one.
+    bool save(const std::string &path, const AdLibrary &library) const;
+    bool load(const std::string &path, const AdLibrary &library);
+    bool empty() const {return codes.empty();}
+    int dims() const {return nDims;}
+    // What build() was asked for. dims() can come out smaller (never more than the frame size, or than the frames
+    // the PCA was learnt from), so this is the one to compare settings against.
+    int requestedDims() const {return nRequestedDims;}
+
+    // Global index of the best of the 'shortlist' candidates, its exact distance in 'dist' and how many exact
+    // distances that took in 'checks'.
+    uint64_t nearest(const AdLibrary &library, const uint8_t *query, unsigned long shortlist, long &dist,
+                     unsigned long *checks = nullptr) const;
+
+    // Bytes per frame of the codes (dims rounded up to 32), against the library's frameStride()
+    int codeStride() const {return nCodeStride;}
+
+private:
+    void encode(const uint8_t *frame, int8_t *code) const;
+
+    int nDims, nRequestedDims, frameSize, nCodeStride;
+    float scale;                    // code = round(projection/scale)
+    std::vector<float> mean;        // frameSize
+    std::vector<float> components;  // nDims rows of frameSize
+    std::vector<int8_t> codes;      // nCodeStride per library frame, zero padded
+};
+
+// Where the compact index of a library is kept
+std::string compactIndexPath(const std::string &libraryPath);
+
+#endif //RETRIEVALT1_COMPACT_H
@@ -1,10 +1,68 @@
+#ifndef RETRIEVALT1_CONFIG
+#define RETRIEVALT1_CONFIG
 #include <string>
+#include "search.h"
+#include "descriptor.h"
 // Lotsa configuration.
 
 struct ConfigContainer {
     // Sampling and descriptor related
     const int sampleRate = 10;
     const int resizeW = 16, resizeH = 16;
+    // Threads for decoding (ads at the same time, or ranges of a long video at the same time). 0 = one per core
+    const int decodeThreads = 1;
+    // A long video is only cut into ranges if each one gets at least this many sampled frames
+    const unsigned long minSampledPerDecodeRange = 2000;
+    // Sampled frames a seek gets checked on (the first ones decoded after it, against the same ones decoded going
+    // forward from somewhere known to be right). More than one, since a seek a few frames off can't be told apart on
+    // a single frame, or on any run of identical ones (black frames, freeze frames).
+    const unsigned long seekCheckFrames = 8;
+    // How frames become descriptors. Libraries remember theirs, so changing this means rebuilding the library.
+    const DescriptorBackend descriptorBackend = DESCRIPTOR_BGR_CUBIC;
+    // DESCRIPTOR_LUMA_AREA only: ask the decoder for frames without converting them to BGR. Backends that can hand
+    // over the gray/Y plane then skip the colour conversion entirely, the rest just ignore it and keep giving BGR.
+    const bool rawLumaDecode = false;
+
+    // Nearest frame search related
+    // SEARCH_BRUTE_FORCE scans every ad frame, SEARCH_VP_TREE goes through an index kept next to the ad library,
+    // SEARCH_PRUNED scans but skips frames that provably can't be the nearest (same results as SEARCH_BRUTE_FORCE),
+    // SEARCH_BATCHED computes every distance too, but for chunks of video frames at a time against cache sized tiles
+    // of ad frames (also the same results), SEARCH_COMPACT looks for a short list of candidates among small PCA codes
+    // of the ad frames kept next to the library and picks the exact nearest of those (approximate), SEARCH_GUIDED is
+    // SEARCH_PRUNED starting from the ad frames right after the previous video frame's match (same results again)
+    const SearchMode searchMode = SEARCH_BRUTE_FORCE;
+    // VP tree: ad frames per leaf, and distances per video frame before settling (0 = always exact)
+    const uint32_t indexLeafSize = 16;
+    const unsigned long indexMaxChecks = 0;
+    // Compact codes: PCA dimensions (one byte each), and how many candidates get their exact distance
+    const int compactDims = 32;
+    const unsigned long compactShortlist = 64;
+    // Guided: how many ad frames past the previous match get tried first
+    const uint32_t guideWindow = 3;
+    // Threads for findNearestFrames (1 = the plain serial loop, 0 = one per core)
+    const int searchThreads = 1;
+    // Sampled video frames handed to a thread (or to the batched search) at a time
+    const unsigned long searchChunkSize = 64;
+
+    // Frames each queue between the streaming pipeline's stages can hold
+    const unsigned long streamQueueCapacity = 64;
+
+    // Server related (see server.h)
+    // Jobs it runs at the same time (0 = one per core), and how often it checks whether the ad library was replaced
+    const int serverJobs = 2;
+    const int serverReloadSeconds = 10;
+
+    // Sharded processing related (see shard.h)
+    // Shards a video gets cut into, and worker processes running at a time (0 = all of them)
+    const int shardCount = 4;
+    const int shardWorkers = 0;
+    // Sampled frames each shard tracks before its own ones. Longer than the longest ad means its trackers almost
+    // always line up with the previous shard's, so the merge doesn't have to track it again.
+    const unsigned long shardOverlap = 600;
+    // Runs every worker, e.g. "ssh render-02" to run them on another machine that sees the same paths through a
+    // shared folder. It's run through /bin/sh and gets the worker's command line as one more argument, quoted for the
+    // shell on the other end. Empty = start them here, straight from their arguments.
+    const std::string shardLauncher = "";
 
     // Detection related
     const int matchStartErrorMargin = 5;
@@ -15,9 +73,17 @@ struct ConfigContainer {
     const double nameFailForgiveness = 0.2;
     const double sequenceFailForgiveness = 0.2;
     const double sequenceUndershootPenalty = 0.5;
+    // Nearest frames further than this (squared distance, 0 = no limit) count as "no ad" for the trackers. Only the
+    // binary nearest frames file (and the streaming pipeline) know the distances.
+    const unsigned long maxNearestDistance = 0;
 
     // Input and output related
     const std::string adExtension = "mpg";
-    const std::string
+    // Whether to also write the old one-.txt-per-ad descriptor files next to the binary ad library
+    const bool exportTextDescriptors = false;
+    // Whether findNearestFrames writes the binary nearest frames file (see nearestframes.h) instead of the text one.
+    // detectAds reads either.
+    const bool binaryNearestFrames = true;
 
-};
\ No newline at end of file
+};
+#endif //RETRIEVALT1_CONFIG
@@ -0,0 +1,91 @@
+#include "descriptor.h"
+#include <algorithm>
+
+const char *descriptorBackendName(DescriptorBackend backend) {
+    switch(backend) {
+        case DESCRIPTOR_BGR_CUBIC: return "bgr-cubic";
+        case DESCRIPTOR_LUMA_AREA: return "luma-area";
+        default: return "unknown";
+    }
+}
+
+// cvtColor's fixed point BGR2GRAY weights (0.114, 0.587, 0.299 scaled by 2^14), so the luma is bit for bit its gray
+static const uint32_t LUMA_B = 1868, LUMA_G = 9617, LUMA_R = 4899, LUMA_SHIFT = 14;
+
+LumaAreaDownscaler::LumaAreaDownscaler(int outW, int outH) : outW(outW), outH(outH), srcW(0), srcH(0),
+                                                             sums((size_t)outW*outH) {}
+
+void LumaAreaDownscaler::prepare(int width, int height) {
+    srcW = width;
+    srcH = height;
+    // Column x goes to cell x*outW/srcW, so every cell gets either floor or ceil(srcW/outW) columns (same for rows)
+    cellOfColumn.resize(srcW);
+    for(int x = 0; x < srcW; x++) {cellOfColumn[x] = (int)((long)x*outW/srcW);}
+    cellOfRow.resize(srcH);
+    for(int y = 0; y < srcH; y++) {cellOfRow[y] = (int)((long)y*outH/srcH);}
+    std::vector<uint32_t> columns(outW, 0), rows(outH, 0);
+    for(int x = 0; x < srcW; x++) {columns[cellOfColumn[x]]++;}
+    for(int y = 0; y < srcH; y++) {rows[cellOfRow[y]]++;}
+    pixelsPerCell.resize((size_t)outW*outH);
+    for(int cy = 0; cy < outH; cy++) {
+        for(int cx = 0; cx < outW; cx++) {pixelsPerCell[cy*outW + cx] = rows[cy]*columns[cx];}
+    }
+}
+
+void LumaAreaDownscaler::apply(const cv::Mat &frame, cv::Mat &descriptor) {
+    int channels = frame.channels();
+    // Smaller than the descriptor (some cells would get no pixels): nothing to average, so let OpenCV stretch it
+    if(frame.cols < outW || frame.rows < outH) {
+        cv::Mat gray;
+        if(channels == 1) {gray = frame;}
+        else if(channels == 2) {cv::extractChannel(frame, gray, 0);}
+        else {cv::cvtColor(frame, gray, channels == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);}
+        cv::resize(gray, descriptor, cv::Size(outW, outH), 0, 0, cv::INTER_AREA);
+        return;
+    }
+    if(frame.cols != srcW || frame.rows != srcH) {prepare(frame.cols, frame.rows);}
+    std::fill(sums.begin(), sums.end(), 0);
+    for(int y = 0; y < srcH; y++) {
+        const uchar *px = frame.ptr<uchar>(y);
+        uint32_t *rowSums = &sums[(size_t)cellOfRow[y]*outW];
+        const int *cell = cellOfColumn.data();
+        if(channels == 1) {
+            for(int x = 0; x < srcW; x++) {rowSums[cell[x]] += px[x];}
+        }
+        else if(channels == 2) {
+            // Packed YUYV: the luma is already there, every other byte
+            for(int x = 0; x < srcW; x++) {rowSums[cell[x]] += px[2*x];}
+        }
+        else {
+            const uint32_t round = 1u << (LUMA_SHIFT - 1);
+            for(int x = 0; x < srcW; x++, px += channels) {
+                rowSums[cell[x]] += (px[0]*LUMA_B + px[1]*LUMA_G + px[2]*LUMA_R + round) >> LUMA_SHIFT;
+            }
+        }
+    }
+    descriptor.create(outH, outW, CV_8UC1);
+    for(int cy = 0; cy < outH; cy++) {
+        uchar *out = descriptor.ptr<uchar>(cy);
+        for(int cx = 0; cx < outW; cx++) {
+            uint32_t count = pixelsPerCell[cy*outW + cx];
+            out[cx] = (uchar)((sums[cy*outW + cx] + count/2)/count);
+        }
+    }
+}
+
+
+FrameDescriber::FrameDescriber(DescriptorBackend backend, int outW, int outH) :
+        describerBackend(backend), outW(outW), outH(outH), luma(outW, outH) {}
+
+void FrameDescriber::describe(const cv::Mat &frame, cv::Mat &descriptor, int frameHeight) {
+    if(describerBackend == DESCRIPTOR_LUMA_AREA) {
+        if(frame.channels() == 1 && frameHeight > 0 && frame.rows > frameHeight) {
+            luma.apply(frame.rowRange(0, frameHeight), descriptor);
+        }
+        else {luma.apply(frame, descriptor);}
+        return;
+    }
+    // Grayscale + resize, which is what turns a frame into its descriptor
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    cv::resize(gray, descriptor, cv::Size(outW, outH), 0, 0, cv::INTER_CUBIC);
+}
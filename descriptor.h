@@ -0,0 +1,57 @@
+// The ways a decoded frame can be turned into its small grayscale descriptor.
+#ifndef RETRIEVALT1_DESCRIPTOR_H
+#define RETRIEVALT1_DESCRIPTOR_H
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+// Stored in the ad library's header, since descriptors from different backends aren't interchangeable
+enum DescriptorBackend {
+    // cvtColor to gray, then an INTER_CUBIC resize (the original way)
+    DESCRIPTOR_BGR_CUBIC = 0,
+    // Luma and an area average in a single pass over the frame (see LumaAreaDownscaler)
+    DESCRIPTOR_LUMA_AREA = 1
+};
+const char *descriptorBackendName(DescriptorBackend backend);
+
+// Turns frames straight into outW x outH luma descriptors: every pixel's luma (same fixed point weights as
+// cvtColor's BGR2GRAY) is added into the sum of the output cell it falls in, and each cell ends up as the rounded
+// average of its pixels. There's no full size gray frame in between, and the per-column cell table and the sums are
+// kept from one frame to the next (they're only rebuilt if the frame size changes), so nothing gets allocated per
+// frame apart from the descriptor itself. Not thread safe: use one per decoding thread.
+class LumaAreaDownscaler {
+public:
+    LumaAreaDownscaler(int outW, int outH);
+    // 'frame' is 8-bit BGR, BGRA, packed YUYV (2 channels, luma in the first), or already single channel luma
+    // (e.g. the Y plane). The last two are what captures with CAP_PROP_CONVERT_RGB off hand back.
+    // 'descriptor' becomes an outH x outW CV_8UC1 Mat.
+    void apply(const cv::Mat &frame, cv::Mat &descriptor);
+
+private:
+    void prepare(int srcW, int srcH);
+    int outW, outH;
+    int srcW, srcH;
+    std::vector<int> cellOfColumn;
+    std::vector<int> cellOfRow;
+    std::vector<uint32_t> pixelsPerCell;
+    std::vector<uint32_t> sums;
+};
+
+// Turns decoded frames into outW x outH descriptors with one backend. Holds the luma backend's buffers, so every
+// decoding thread needs its own.
+class FrameDescriber {
+public:
+    FrameDescriber(DescriptorBackend backend, int outW, int outH);
+    // frameHeight is the video's real height, for single channel frames from captures that put the chroma planes
+    // under the Y plane (those rows get cut off). 0 = use the whole frame.
+    void describe(const cv::Mat &frame, cv::Mat &descriptor, int frameHeight = 0);
+    DescriptorBackend backend() const {return describerBackend;}
+
+private:
+    DescriptorBackend describerBackend;
+    int outW, outH;
+    LumaAreaDownscaler luma;
+    cv::Mat gray;
+};
+
+#endif //RETRIEVALT1_DESCRIPTOR_H
@@ -0,0 +1,204 @@
+#include "detector.h"
+#include "utils.h"
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+
+VideoInfo::VideoInfo(unsigned long t, double d, int sampleRate) {
+    totalFrames = t;
+    duration = d;
+    totalSampled = amountSampled(totalFrames, sampleRate);
+}
+
+bool trackFrame(VideoMatchTracker &tracker, const VideoInfo &adInfo, bool nameMatches, int currNearFrame,
+                int frameInd, const ConfigContainer &config, int &matchStart) {
+    if(nameMatches) {
+        // If the name matched the name of the ad we're looking at, let's see if we are starting a match
+        if(!tracker.matching && (currNearFrame < config.matchStartErrorMargin)) {
+            tracker.matching = true;
+            // Start the sequence at whichever frame number of the ad is closes to the frame of the video
+            tracker.sequenceTracker = currNearFrame;
+            // Remember the index (relative to the long video) of this frame
+            tracker.matchStart = frameInd;
+
+        }
+        else if(tracker.matching) {
+            // If we're already in the process of matching, let's track our progress
+            if(tracker.sequenceTracker <= currNearFrame){
+                double nForgive = config.nameFailForgiveness;
+                // If the current nearest frame says it's a frame number bigger than where the sequence was
+                // then let's decrease the name fail score a bit, since this is a good match.
+                tracker.nameFailScore = std::max(tracker.nameFailScore-nForgive, (double)0);
+                if(currNearFrame > (tracker.sequenceTracker + 5)) {
+                    // But the current nearest says it's a frame too far from our sequence, that may be bad
+                    double penalty =  ((currNearFrame-tracker.sequenceTracker)*config.sequenceOvershootFactor);
+                    tracker.sequenceFailScore += penalty;
+                }
+                else{
+                    double sForgive = config.sequenceFailForgiveness;
+                    // If not, then the sequence is going well, let's forgive a bit of its past mistakes
+                    tracker.sequenceFailScore = std::max(tracker.sequenceFailScore - sForgive, (double) 0);
+                }
+                // Since we're matching and the nearest frame number did go up, increase the sequence by one
+                tracker.sequenceTracker +=1;
+            }
+            else {
+                // The current nearest frame says its from a point before where we are in the sequence
+                tracker.sequenceFailScore+=config.sequenceUndershootPenalty;
+            }
+        }
+    } //endif(nameMatches)
+    else {
+        // The name of the nearest frame didn't match the ad we're looking up
+        if(tracker.matching) {
+            // So if we were doing a match, increase the name fail score
+            tracker.nameFailScore += 1;
+        }
+    }
+    bool failLimitReached = (tracker.nameFailScore > config.nameFailLimit ||
+                             tracker.sequenceFailScore > config.sequenceFailLimit);
+    // Evaluate: Are we really still matching an ad? If there's too many fails, then prolly not really.
+    if(tracker.matching && failLimitReached){
+        // Reset the tracker
+        tracker = VideoMatchTracker();
+    }
+    // error margin (-5): If we've matched this much, might as well count it at this point.
+    if(tracker.sequenceTracker > (adInfo.totalSampled - config.matchEndErrorMargin)) {
+        matchStart = tracker.matchStart;
+        tracker = VideoMatchTracker();
+        return true;
+    }
+    return false;
+}
+
+void writeDetection(std::ostream &out, const std::string &videoName, const Detection &detection,
+                    const AdDirectory &adDirectory, int samplingRate, double fps) {
+    // Notice this is zero-indexed, to get the moment the frame *starts* (so it could be 0)
+    int actualFrameIndex = detection.matchStart*samplingRate;
+    double startTime = ((double)actualFrameIndex/fps);
+    // We're specifically matching for entire ads (and some of these conditions reflect that)
+    // so might as well use 'duration'
+    out << videoName << '\t' << startTime << '\t'
+        << adDirectory.info[detection.ad].duration/1000.0 << '\t' << adDirectory.names[detection.ad] << std::endl;
+}
+
+AdDetector::AdDetector(const AdDirectory &adDirectory, const ConfigContainer &config) :
+        adDirectory(adDirectory), trackers(adDirectory.size()), isActive(adDirectory.size(), 0),
+        config(config), frameInd(0) {}
+
+void AdDetector::push(const NearestInfo &nearest, std::vector<Detection> &detections) {
+    // Trackers this frame can change: the ones mid-match, and the one of the nearest frame's ad (if it's one we
+    // have, anything else counts as no ad)
+    int nearestAd = nearest.ad < (int)isActive.size() ? nearest.ad : -1;
+    if(nearestAd >= 0 && !isActive[nearestAd]) {active.push_back(nearestAd);}
+    size_t firstDetection = detections.size();
+    size_t kept = 0;
+    for(size_t i = 0; i < active.size(); i++) {
+        int ad = active[i];
+        VideoMatchTracker &tracker = trackers[ad];
+        int matchStart;
+        if(trackFrame(tracker, adDirectory.info[ad], ad == nearestAd, nearest.frame, frameInd, config, matchStart)) {
+            Detection detection;
+            detection.ad = ad;
+            detection.matchStart = matchStart;
+            detections.push_back(detection);
+        }
+        // Whatever isn't matching anymore is back to a fresh tracker, and drops out until its ad shows up again
+        isActive[ad] = tracker.matching;
+        if(tracker.matching) {active[kept++] = ad;}
+    }
+    active.resize(kept);
+    if(detections.size() - firstDetection > 1) {
+        std::sort(detections.begin() + firstDetection, detections.end(),
+                  [](const Detection &a, const Detection &b) {return a.ad < b.ad;});
+    }
+    frameInd++;
+}
+
+int AdDirectory::add(const std::string &name, const VideoInfo &adInfo) {
+    auto found = ids.find(name);
+    if(found != ids.end()) {
+        info[found->second] = adInfo;
+        return found->second;
+    }
+    int id = (int)names.size();
+    ids[name] = id;
+    names.push_back(name);
+    info.push_back(adInfo);
+    return id;
+}
+
+int AdDirectory::find(const std::string &name) const {
+    auto found = ids.find(name);
+    return found == ids.end() ? -1 : found->second;
+}
+
+DetectorState AdDetector::state() const {
+    DetectorState state(frameInd);
+    for(int ad: active) {state.active.push_back(std::make_pair(ad, trackers[ad]));}
+    std::sort(state.active.begin(), state.active.end(),
+              [](const std::pair<int, VideoMatchTracker> &a, const std::pair<int, VideoMatchTracker> &b) {
+                  return a.first < b.first;
+              });
+    return state;
+}
+
+void AdDetector::restore(const DetectorState &state) {
+    for(int ad: active) {
+        trackers[ad] = VideoMatchTracker();
+        isActive[ad] = 0;
+    }
+    active.clear();
+    for(const std::pair<int, VideoMatchTracker> &tracker: state.active) {
+        if(tracker.first < 0 || tracker.first >= (int)trackers.size()) {continue;}
+        trackers[tracker.first] = tracker.second;
+        isActive[tracker.first] = 1;
+        active.push_back(tracker.first);
+    }
+    frameInd = state.frameInd;
+}
+
+bool DetectorState::operator==(const DetectorState &other) const {
+    if(frameInd != other.frameInd || active.size() != other.active.size()) {return false;}
+    for(size_t i = 0; i < active.size(); i++) {
+        const VideoMatchTracker &a = active[i].second, &b = other.active[i].second;
+        if(active[i].first != other.active[i].first || a.nameMatches != b.nameMatches ||
+           a.sequenceTracker != b.sequenceTracker || a.nameFailScore != b.nameFailScore ||
+           a.sequenceFailScore != b.sequenceFailScore || a.matchStart != b.matchStart || a.matching != b.matching) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// "[frameInd] [active trackers]" and then for each one
+// " [ad] [nameMatches] [sequenceTracker] [nameFailScore] [sequenceFailScore] [matchStart] [matching]"
+void DetectorState::write(std::ostream &out) const {
+    std::streamsize precision = out.precision(std::numeric_limits<double>::max_digits10);
+    out << frameInd << ' ' << active.size();
+    for(const std::pair<int, VideoMatchTracker> &tracker: active) {
+        const VideoMatchTracker &t = tracker.second;
+        out << ' ' << tracker.first << ' ' << t.nameMatches << ' ' << t.sequenceTracker << ' ' << t.nameFailScore
+            << ' ' << t.sequenceFailScore << ' ' << t.matchStart << ' ' << (t.matching ? 1 : 0);
+    }
+    out << '\n';
+    out.precision(precision);
+}
+
+bool DetectorState::read(std::istream &in) {
+    size_t count;
+    active.clear();
+    if(!(in >> frameInd >> count)) {return false;}
+    for(size_t i = 0; i < count; i++) {
+        std::pair<int, VideoMatchTracker> tracker;
+        VideoMatchTracker &t = tracker.second;
+        int matching;
+        if(!(in >> tracker.first >> t.nameMatches >> t.sequenceTracker >> t.nameFailScore >> t.sequenceFailScore
+                >> t.matchStart >> matching)) {
+            return false;
+        }
+        t.matching = matching != 0;
+        active.push_back(tracker);
+    }
+    return true;
+}
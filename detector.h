@@ -0,0 +1,117 @@
+// Ad detection: following the nearest ad frame of every sampled frame of the long video and deciding when a whole
+// ad has played.
+#ifndef RETRIEVALT1_DETECTOR_H
+#define RETRIEVALT1_DETECTOR_H
+#include "config.cpp"
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Represents the description of a single nearest frame:
+//     <ID of the ad (see AdDirectory, -1 if it isn't one we know), index of the frame (relative to sampled frames)>
+struct NearestInfo {
+    int ad;
+    int frame;
+    NearestInfo() {ad=-1; frame=0;}
+    NearestInfo(int a, int f) {ad = a; frame = f;}
+};
+
+// Oh hey, I'm using structs now! These are gonna be basically ad directory entries (except in memory instead of a file)
+struct VideoInfo {
+    unsigned long totalFrames;
+    double duration;
+    unsigned long totalSampled;
+    VideoInfo() {totalFrames = 0; duration = 0; totalSampled = 0;}
+    VideoInfo(unsigned long t, double d, int sampleRate);
+};
+
+// All known ads, by dense integer ID (0, 1, 2...). Names get turned into IDs once, when loading, so from then on
+// nothing compares strings.
+struct AdDirectory {
+    std::vector<std::string> names;
+    std::vector<VideoInfo> info;
+    std::unordered_map<std::string, int> ids;   // smh, cv::String doesn't hash!?
+    // Adds an ad (or updates its info if the name is already there) and returns its ID
+    int add(const std::string &name, const VideoInfo &adInfo);
+    // ID of the ad with that name, -1 if there isn't one
+    int find(const std::string &name) const;
+    int size() const {return (int)names.size();}
+};
+
+// Used to track possible matches of a video inside the long video.
+struct VideoMatchTracker {
+    int nameMatches;
+    int sequenceTracker;
+    double nameFailScore;
+    double sequenceFailScore;
+    int matchStart;
+    bool matching;
+    VideoMatchTracker() {
+        matchStart = 0;
+        nameMatches = 0;
+        sequenceTracker = 0;
+        nameFailScore = 0;
+        sequenceFailScore = 0;
+        matching = false;
+    }
+};
+
+// One step of an ad's tracker: sampled frame frameInd of the long video, whose nearest frame was frame currNearFrame
+// of either this ad (nameMatches) or another one. Returns true if that completed a match of the whole ad, in which
+// case matchStart gets where it started (in sampled frames) and the tracker is reset.
+bool trackFrame(VideoMatchTracker &tracker, const VideoInfo &adInfo, bool nameMatches, int currNearFrame,
+                int frameInd, const ConfigContainer &config, int &matchStart);
+
+// Snapshot of an AdDetector in between two frames: the next frame's index and the trackers that are mid-match (every
+// other one is a fresh VideoMatchTracker). Two detectors with equal snapshots give the same detections from there on,
+// whatever frames got each of them there.
+struct DetectorState {
+    int frameInd;
+    std::vector<std::pair<int, VideoMatchTracker>> active;     // by ad ID, sorted by it
+    DetectorState() {frameInd = 0;}
+    explicit DetectorState(int frameInd) {this->frameInd = frameInd;}
+    // Exact comparison (scores included), which is what it takes for the detections to be the same
+    bool operator==(const DetectorState &other) const;
+    bool operator!=(const DetectorState &other) const {return !(*this == other);}
+    // One line, e.g. for a shard's result file. Scores are written with enough digits to read back the same.
+    void write(std::ostream &out) const;
+    bool read(std::istream &in);
+};
+
+// A whole ad found in the long video
+struct Detection {
+    int ad;
+    int matchStart;         // sampled frame of the long video where it started
+};
+
+// Writes a detection as a line of the results file: "[video] [start (s)] [duration (s)] [ad]", tab separated
+void writeDetection(std::ostream &out, const std::string &videoName, const Detection &detection,
+                    const AdDirectory &adDirectory, int samplingRate, double fps);
+
+// Runs one tracker per ad over the sampled frames of the long video, one frame at a time, so detections come out
+// as soon as the frame completing them is seen.
+// A tracker that isn't matching only changes when its own ad is the nearest one, so each frame only steps the
+// trackers that are mid-match plus the one of the frame's ad. That's the same result as stepping all of them,
+// in time that depends on how many ads are matching at once instead of on the size of the library.
+class AdDetector {
+public:
+    AdDetector(const AdDirectory &adDirectory, const ConfigContainer &config);
+    // The nearest ad frame of the next sampled frame. Matches it completes are appended to 'detections'
+    // (by ad ID, if there's more than one).
+    void push(const NearestInfo &nearest, std::vector<Detection> &detections);
+    int framesSeen() const {return frameInd;}
+    DetectorState state() const;
+    // Picks up from a snapshot (possibly another detector's, over the same ad directory)
+    void restore(const DetectorState &state);
+
+private:
+    const AdDirectory &adDirectory;
+    std::vector<VideoMatchTracker> trackers;   // by ad ID
+    std::vector<int> active;                   // IDs of the trackers that are matching
+    std::vector<char> isActive;
+    ConfigContainer config;
+    int frameInd;
+};
+
+#endif //RETRIEVALT1_DETECTOR_H
@@ -0,0 +1,24 @@
+#include "hash.h"
+#include <fstream>
+#include <vector>
+
+uint64_t fnv1a64(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool hashFile(const std::string &path, uint64_t &hash) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) {return false;}
+    std::vector<char> buffer(1 << 20);
+    hash = FNV1A64_INIT;
+    while(file) {
+        file.read(buffer.data(), buffer.size());
+        hash = fnv1a64(buffer.data(), (size_t)file.gcount(), hash);
+    }
+    return file.eof();
+}
@@ -0,0 +1,16 @@
+// Non-cryptographic hashing for telling whether files changed.
+#ifndef RETRIEVALT1_HASH_H
+#define RETRIEVALT1_HASH_H
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+const uint64_t FNV1A64_INIT = 14695981039346656037ULL;
+
+// FNV-1a, 64 bit. Pass the previous result as 'hash' to keep hashing a stream piece by piece.
+uint64_t fnv1a64(const void *data, size_t size, uint64_t hash = FNV1A64_INIT);
+
+// fnv1a64 of a whole file, read in chunks. False if it can't be read.
+bool hashFile(const std::string &path, uint64_t &hash);
+
+#endif //RETRIEVALT1_HASH_H
@@ -0,0 +1,116 @@
+#include "instrumentation.h"
+#include <fstream>
+#include <iostream>
+#include <ctime>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+const char *stageName(Stage stage) {
+    switch(stage) {
+        case STAGE_BUILD_LIBRARY: return "makeVideoDescriptorFiles";
+        case STAGE_VIDEO_TO_DESCRIPTOR: return "videoToDescriptor";
+        case STAGE_READ_DESCRIPTORS: return "readDescriptors";
+        case STAGE_FIND_NEAREST_FRAMES: return "findNearestFrames";
+        case STAGE_DETECT_ADS: return "detectAds";
+        case STAGE_STREAM_DETECT_ADS: return "streamDetectAds";
+        default: return "unknown";
+    }
+}
+
+void StageCounters::reset() {
+    calls = 0;
+    wallNs = 0;
+    cpuNs = 0;
+    framesDecoded = 0;
+    framesRetrieved = 0;
+    framesSearched = 0;
+    framesTracked = 0;
+    distances = 0;
+    bytesRead = 0;
+    peakRssKb = 0;
+}
+
+unsigned long processCpuNs() {
+    timespec now;
+    if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now) != 0) {return 0;}
+    return (unsigned long)now.tv_sec*1000000000UL + (unsigned long)now.tv_nsec;
+}
+
+long peakRssKb() {
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {return 0;}
+    // Linux gives it in KB already
+    return usage.ru_maxrss;
+}
+
+unsigned long fileBytes(const std::string &path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {return 0;}
+    return (unsigned long)st.st_size;
+}
+
+RunInstruments::RunInstruments() {reset();}
+
+void RunInstruments::reset() {
+    for(StageCounters &counters: stages) {counters.reset();}
+    runStart = std::chrono::steady_clock::now();
+    runCpuStartNs = processCpuNs();
+}
+
+void RunInstruments::writeReport(std::ostream &out) const {
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+    out << "{\n";
+    out << "  \"wallSeconds\": " << wallSeconds << ",\n";
+    out << "  \"cpuSeconds\": " << (processCpuNs() - runCpuStartNs)/1e9 << ",\n";
+    out << "  \"peakRssKb\": " << peakRssKb() << ",\n";
+    out << "  \"stages\": {";
+    bool first = true;
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        const StageCounters &counters = stages[i];
+        // Stages the run never went through are left out
+        if(counters.calls == 0) {continue;}
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "    \"" << stageName((Stage)i) << "\": {"
+            << "\"calls\": " << counters.calls
+            << ", \"wallSeconds\": " << counters.wallNs/1e9
+            << ", \"cpuSeconds\": " << counters.cpuNs/1e9
+            << ", \"framesDecoded\": " << counters.framesDecoded
+            << ", \"framesRetrieved\": " << counters.framesRetrieved
+            << ", \"framesSearched\": " << counters.framesSearched
+            << ", \"framesTracked\": " << counters.framesTracked
+            << ", \"distances\": " << counters.distances
+            << ", \"bytesRead\": " << counters.bytesRead
+            << ", \"peakRssKb\": " << counters.peakRssKb << "}";
+    }
+    out << (first ? "}\n" : "\n  }\n");
+    out << "}\n";
+}
+
+bool RunInstruments::writeReport(const std::string &path) const {
+    std::ofstream file(path);
+    writeReport(file);
+    file.close();
+    if(!file) {
+        std::cerr << "ERROR: Couldn't write run report " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+RunInstruments &instruments() {
+    // Function local static, so it exists before any stage (even one in a static initializer) touches it
+    static RunInstruments runInstruments;
+    return runInstruments;
+}
+
+StageTimer::StageTimer(Stage stage) : counters(instruments().stage(stage)),
+                                      wallStart(std::chrono::steady_clock::now()), cpuStartNs(processCpuNs()) {}
+
+StageTimer::~StageTimer() {
+    auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wallStart);
+    counters.calls++;
+    counters.wallNs += (unsigned long)wall.count();
+    counters.cpuNs += processCpuNs() - cpuStartNs;
+    counters.peakRssKb = peakRssKb();
+}
@@ -0,0 +1,78 @@
+// Per-stage counters and timers for the run report (a JSON summary of where a run spent its time).
+#ifndef RETRIEVALT1_INSTRUMENTATION_H
+#define RETRIEVALT1_INSTRUMENTATION_H
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+enum Stage {
+    STAGE_BUILD_LIBRARY,
+    STAGE_VIDEO_TO_DESCRIPTOR,
+    STAGE_READ_DESCRIPTORS,
+    STAGE_FIND_NEAREST_FRAMES,
+    STAGE_DETECT_ADS,
+    STAGE_STREAM_DETECT_ADS,
+    STAGE_COUNT
+};
+const char *stageName(Stage stage);
+
+// Everything a stage adds up over all its calls. The counters are atomic, so any thread can add to them, but they're
+// meant to be added to once per call (or per chunk/range), not once per frame.
+struct StageCounters {
+    std::atomic<unsigned long> calls;
+    std::atomic<unsigned long> wallNs;
+    // Process CPU time while the stage ran, so it includes the stage's worker threads (and anything else that ran at
+    // the same time, e.g. calls of a stage that overlap on a thread pool count that time more than once)
+    std::atomic<unsigned long> cpuNs;
+    std::atomic<unsigned long> framesDecoded;      // grabbed from the video
+    std::atomic<unsigned long> framesRetrieved;    // turned into descriptors (or read back from a descriptor file)
+    std::atomic<unsigned long> framesSearched;     // nearest frame queries
+    std::atomic<unsigned long> framesTracked;      // sampled frames fed to the match trackers
+    std::atomic<unsigned long> distances;          // distance computations started
+    std::atomic<unsigned long> bytesRead;          // input files (videos, descriptor files, library, nearest frames)
+    std::atomic<long> peakRssKb;                   // process peak RSS when the last call finished
+    StageCounters() {reset();}
+    void reset();
+};
+
+// The counters of every stage, plus when the run started. There's a single one for the whole process.
+class RunInstruments {
+public:
+    RunInstruments();
+    StageCounters &stage(Stage stage) {return stages[stage];}
+    const StageCounters &stage(Stage stage) const {return stages[stage];}
+    // Zeroes everything and restarts the run clock
+    void reset();
+    void writeReport(std::ostream &out) const;
+    bool writeReport(const std::string &path) const;
+
+private:
+    StageCounters stages[STAGE_COUNT];
+    std::chrono::steady_clock::time_point runStart;
+    unsigned long runCpuStartNs;
+};
+RunInstruments &instruments();
+
+// Times one call of a stage, from construction to destruction, and counts the call.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+
+private:
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+    StageCounters &counters;
+    std::chrono::steady_clock::time_point wallStart;
+    unsigned long cpuStartNs;
+};
+
+// CPU time of the whole process so far (all threads), in ns
+unsigned long processCpuNs();
+// Peak resident set size of the process so far, in KB
+long peakRssKb();
+// Size of a file in bytes (0 if it can't be stat'd), for the bytesRead counters
+unsigned long fileBytes(const std::string &path);
+
+#endif //RETRIEVALT1_INSTRUMENTATION_H
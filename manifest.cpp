@@ -0,0 +1,60 @@
+#include "manifest.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include <sys/stat.h>
+
+std::string manifestPath(const std::string &libraryPath) {
+    return libraryPath + ".manifest";
+}
+
+bool fileStat(const std::string &path, uint64_t &size, int64_t &mtime) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {return false;}
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+bool LibraryManifest::read(const std::string &manifestPath) {
+    entries.clear();
+    std::ifstream file(manifestPath);
+    std::string line;
+    if(!std::getline(file, line)) {return false;}
+    std::stringstream lineStream(line);
+    if(!(lineStream >> sampleRate >> resizeW >> resizeH)) {return false;}
+    // Manifests from before there was a choice of backend don't have it, and were all made with the first one
+    if(!(lineStream >> descriptorBackend)) {descriptorBackend = 0;}
+    ManifestEntry entry;
+    while(std::getline(file, entry.name) && std::getline(file, entry.path) && std::getline(file, line)) {
+        lineStream = std::stringstream(line);
+        if(!(lineStream >> entry.size >> entry.mtime >> std::hex >> entry.hash)) {return false;}
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool LibraryManifest::write(const std::string &manifestPath) const {
+    std::string tmpPath = manifestPath + ".tmp";
+    std::ofstream file(tmpPath);
+    file << sampleRate << ' ' << resizeW << ' ' << resizeH << ' ' << descriptorBackend << '\n';
+    for(const ManifestEntry &entry: entries) {
+        file << entry.name << '\n' << entry.path << '\n'
+             << entry.size << ' ' << entry.mtime << ' ' << std::hex << entry.hash << std::dec << '\n';
+    }
+    file.close();
+    if(!file || std::rename(tmpPath.c_str(), manifestPath.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write manifest " << manifestPath << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+const ManifestEntry *LibraryManifest::find(const std::string &path) const {
+    for(const ManifestEntry &entry: entries) {
+        if(entry.path == path) {return &entry;}
+    }
+    return nullptr;
+}
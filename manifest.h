@@ -0,0 +1,38 @@
+// Record of which source videos went into an ad library, so it can be updated without re-extracting everything.
+#ifndef RETRIEVALT1_MANIFEST_H
+#define RETRIEVALT1_MANIFEST_H
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ManifestEntry {
+    std::string name;
+    std::string path;
+    uint64_t size;
+    int64_t mtime;      // seconds since the epoch
+    uint64_t hash;      // fnv1a64 of the whole file
+};
+
+// Text file, next to the library. First line is "[sampleRate] [resizeW] [resizeH] [descriptorBackend]", then for
+// every ad:
+//   [name]
+//   [path]
+//   [size] [mtime] [hash in hex]
+// (names and paths can have spaces, so they get their own lines, same as in the ad directory)
+struct LibraryManifest {
+    int sampleRate, resizeW, resizeH;
+    int descriptorBackend;
+    std::vector<ManifestEntry> entries;
+    LibraryManifest() {sampleRate = 0; resizeW = 0; resizeH = 0; descriptorBackend = 0;}
+    bool read(const std::string &manifestPath);
+    bool write(const std::string &manifestPath) const;
+    // Entry for the given source path, nullptr if it isn't there
+    const ManifestEntry *find(const std::string &path) const;
+};
+
+std::string manifestPath(const std::string &libraryPath);
+
+// Size and modification time of a file. False if it can't be stat'd.
+bool fileStat(const std::string &path, uint64_t &size, int64_t &mtime);
+
+#endif //RETRIEVALT1_MANIFEST_H
@@ -0,0 +1,127 @@
+#include "nearestframes.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool writeNearestFramesBinary(const std::string &path, const std::string &videoName, uint64_t totalFrames,
+                              double duration, uint32_t sampleRate, uint32_t frameW, uint32_t frameH,
+                              const std::vector<std::string> &adNames, const std::vector<NearestFrameRecord> &records) {
+    NearestFramesHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, NEAREST_FRAMES_MAGIC, sizeof(NEAREST_FRAMES_MAGIC));
+    header.version = NEAREST_FRAMES_VERSION;
+    header.sampleRate = sampleRate;
+    header.frameW = frameW;
+    header.frameH = frameH;
+    header.adCount = (uint32_t)adNames.size();
+    header.videoNameLength = (uint32_t)videoName.size();
+    header.totalFrames = totalFrames;
+    header.duration = duration;
+    header.recordCount = records.size();
+    std::vector<NearestFramesName> table(adNames.size());
+    std::string names = videoName;
+    for(size_t i = 0; i < adNames.size(); i++) {
+        table[i].nameOffset = (uint32_t)names.size();
+        table[i].nameLength = (uint32_t)adNames[i].size();
+        names += adNames[i];
+    }
+    header.namesOffset = sizeof(NearestFramesHeader) + table.size()*sizeof(NearestFramesName);
+    header.recordsOffset = ((header.namesOffset + names.size() + 7)/8)*8;
+    header.fileSize = header.recordsOffset + records.size()*sizeof(NearestFrameRecord);
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    if(!table.empty()) {file.write((const char *)table.data(), table.size()*sizeof(NearestFramesName));}
+    file.write(names.data(), names.size());
+    std::vector<char> padding(header.recordsOffset - (header.namesOffset + names.size()), 0);
+    file.write(padding.data(), padding.size());
+    if(!records.empty()) {file.write((const char *)records.data(), records.size()*sizeof(NearestFrameRecord));}
+    file.close();
+    if(!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write nearest frames file " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+NearestFramesFile::NearestFramesFile() : base(nullptr), mappedSize(0), header(nullptr), table(nullptr),
+                                         names(nullptr), records(nullptr) {}
+
+NearestFramesFile::~NearestFramesFile() {close();}
+
+void NearestFramesFile::close() {
+    if(base != nullptr) {munmap(base, mappedSize);}
+    base = nullptr;
+    mappedSize = 0;
+    header = nullptr;
+    table = nullptr;
+    names = nullptr;
+    records = nullptr;
+}
+
+bool NearestFramesFile::isBinary(const std::string &path) {
+    char magic[sizeof(NEAREST_FRAMES_MAGIC)];
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, NEAREST_FRAMES_MAGIC, sizeof(magic)) == 0;
+}
+
+bool NearestFramesFile::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "ERROR: Couldn't open nearest frames file " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NearestFramesHeader)) {
+        std::cerr << "ERROR: " << path << " is too small to be a nearest frames file" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mapped == MAP_FAILED) {
+        std::cerr << "ERROR: Couldn't map nearest frames file " << path << std::endl;
+        return false;
+    }
+    base = mapped;
+    mappedSize = (size_t)st.st_size;
+    header = (const NearestFramesHeader *)base;
+    const char *bytes = (const char *)base;
+    // The names block runs from namesOffset to recordsOffset. Sizes are checked by dividing, so a huge count can't
+    // wrap around into something that looks fine.
+    bool valid = std::memcmp(header->magic, NEAREST_FRAMES_MAGIC, sizeof(NEAREST_FRAMES_MAGIC)) == 0 &&
+                 header->version == NEAREST_FRAMES_VERSION &&
+                 header->fileSize == mappedSize &&
+                 header->namesOffset >= sizeof(NearestFramesHeader) + header->adCount*sizeof(NearestFramesName) &&
+                 header->namesOffset <= header->recordsOffset &&
+                 header->recordsOffset % 8 == 0 && header->recordsOffset <= mappedSize &&
+                 header->recordCount <= (mappedSize - header->recordsOffset)/sizeof(NearestFrameRecord) &&
+                 header->videoNameLength <= header->recordsOffset - header->namesOffset;
+    if(valid) {
+        const NearestFramesName *entries = (const NearestFramesName *)(bytes + sizeof(NearestFramesHeader));
+        uint64_t namesSize = header->recordsOffset - header->namesOffset;
+        for(uint32_t ad = 0; valid && ad < header->adCount; ad++) {
+            valid = (uint64_t)entries[ad].nameOffset + entries[ad].nameLength <= namesSize;
+        }
+    }
+    if(!valid) {
+        std::cerr << "ERROR: " << path << " isn't a nearest frames file (or was written by another version)"
+                  << std::endl;
+        close();
+        return false;
+    }
+    table = (const NearestFramesName *)(bytes + sizeof(NearestFramesHeader));
+    names = bytes + header->namesOffset;
+    records = (const NearestFrameRecord *)(bytes + header->recordsOffset);
+    // Read once, front to back
+    madvise(base, mappedSize, MADV_SEQUENTIAL);
+    return true;
+}
@@ -0,0 +1,77 @@
+// Binary nearest frames file: what findNearestFrames hands over to detectAds, one fixed size record per sampled frame.
+#ifndef RETRIEVALT1_NEARESTFRAMES_H
+#define RETRIEVALT1_NEARESTFRAMES_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// File layout (native endianness):
+//   NearestFramesHeader
+//   NearestFramesName[adCount]                   (the ads the records point to, in ad ID order)
+//   names block (video name, then the ad names back to back, not null terminated)
+//   NearestFrameRecord[recordCount]              (8-byte aligned, one per sampled frame of the video)
+const char NEAREST_FRAMES_MAGIC[8] = {'A', 'D', 'N', 'E', 'A', 'R', 'F', 'R'};
+const uint32_t NEAREST_FRAMES_VERSION = 1;
+
+struct NearestFramesHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t frameW, frameH;
+    uint32_t adCount;
+    uint32_t videoNameLength;   // the video name is the start of the names block
+    uint64_t totalFrames;       // of the video
+    double duration;            // ms
+    uint64_t recordCount;
+    uint64_t namesOffset;
+    uint64_t recordsOffset;
+    uint64_t fileSize;
+};
+
+struct NearestFramesName {
+    uint32_t nameOffset;        // relative to the start of the names block
+    uint32_t nameLength;
+};
+
+struct NearestFrameRecord {
+    uint32_t ad;                // index into the name table
+    uint32_t adFrame;           // 1-indexed, relative to the ad's sampled frames (same as in the text format)
+    uint32_t dist;              // squared euclidean distance
+};
+
+// Writes the file (through path + ".tmp" and a rename). 'records' are in sampled frame order.
+bool writeNearestFramesBinary(const std::string &path, const std::string &videoName, uint64_t totalFrames,
+                              double duration, uint32_t sampleRate, uint32_t frameW, uint32_t frameH,
+                              const std::vector<std::string> &adNames, const std::vector<NearestFrameRecord> &records);
+
+// Read-only view of a file, mmap'd and used in place like the ad library.
+class NearestFramesFile {
+public:
+    NearestFramesFile();
+    ~NearestFramesFile();
+    // False (and prints why) if it isn't a usable nearest frames file
+    bool open(const std::string &path);
+    void close();
+    // Whether the file starts like one of these (so callers can fall back to the old text format)
+    static bool isBinary(const std::string &path);
+
+    const NearestFramesHeader &info() const {return *header;}
+    std::string videoName() const {return std::string(names, header->videoNameLength);}
+    uint32_t adCount() const {return header->adCount;}
+    std::string adName(uint32_t ad) const {return std::string(names + table[ad].nameOffset, table[ad].nameLength);}
+    uint64_t recordCount() const {return header->recordCount;}
+    const NearestFrameRecord &record(uint64_t i) const {return records[i];}
+
+private:
+    NearestFramesFile(const NearestFramesFile &) = delete;
+    NearestFramesFile &operator=(const NearestFramesFile &) = delete;
+    void *base;
+    size_t mappedSize;
+    const NearestFramesHeader *header;
+    const NearestFramesName *table;
+    const char *names;
+    const NearestFrameRecord *records;
+};
+
+#endif //RETRIEVALT1_NEARESTFRAMES_H
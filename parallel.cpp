@@ -0,0 +1,69 @@
+#include "parallel.h"
+#include <algorithm>
+
+int hardwareThreads() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : (int)n;
+}
+
+ThreadPool::ThreadPool(int threads) : generation(0), busy(0), stopping(false), body(nullptr), total(0),
+                                      chunkSize(1), nextChunk(0) {
+    if(threads <= 0) {threads = hardwareThreads();}
+    for(int i = 1; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(std::thread &worker: workers) {worker.join();}
+}
+
+void ThreadPool::runChunks() {
+    while(true) {
+        unsigned long begin = nextChunk.fetch_add(chunkSize);
+        if(begin >= total) {return;}
+        (*body)(begin, std::min(begin + chunkSize, total));
+    }
+}
+
+void ThreadPool::workerLoop() {
+    unsigned long seen = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] {return stopping || generation != seen;});
+            if(stopping) {return;}
+            seen = generation;
+        }
+        runChunks();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(--busy == 0) {done.notify_one();}
+        }
+    }
+}
+
+void ThreadPool::parallelFor(unsigned long total, unsigned long chunkSize,
+                             const std::function<void(unsigned long, unsigned long)> &body) {
+    if(chunkSize == 0) {chunkSize = 1;}
+    std::lock_guard<std::mutex> callLock(callMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->body = &body;
+        this->total = total;
+        this->chunkSize = chunkSize;
+        nextChunk = 0;
+        busy = (int)workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    runChunks();
+    // Every worker has to check in before the next loop can reuse the job fields
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] {return busy == 0;});
+}
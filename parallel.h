@@ -0,0 +1,47 @@
+// A small pool of worker threads for splitting loops over frames.
+#ifndef RETRIEVALT1_PARALLEL_H
+#define RETRIEVALT1_PARALLEL_H
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // threads <= 0 means one per hardware thread. The thread calling parallelFor counts as one of them.
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+    int size() const {return (int)workers.size() + 1;}
+    // Calls body(begin, end) over [0, total) in chunks of chunkSize and returns once all of them are done.
+    // Chunks are handed out through an atomic counter, so threads that finish early just grab the next one.
+    // Calls from different threads are run one after the other.
+    void parallelFor(unsigned long total, unsigned long chunkSize,
+                     const std::function<void(unsigned long, unsigned long)> &body);
+
+private:
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    void workerLoop();
+    void runChunks();
+
+    std::vector<std::thread> workers;
+    std::mutex callMutex;   // one parallelFor at a time
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long generation;
+    int busy;
+    bool stopping;
+    // The loop currently being run
+    const std::function<void(unsigned long, unsigned long)> *body;
+    unsigned long total;
+    unsigned long chunkSize;
+    std::atomic<unsigned long> nextChunk;
+};
+
+// What 'threads <= 0' turns into
+int hardwareThreads();
+
+#endif //RETRIEVALT1_PARALLEL_H
@@ -0,0 +1,1178 @@
+#include "pipeline.h"
+#include "manifest.h"
+#include "hash.h"
+#include "queue.h"
+#include "nearestframes.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <cstdint>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+ConfigContainer Config;
+using namespace cv;
+
+// Every how many frames are we going to get a frame to make a descriptor?
+const int sampleRate = Config.sampleRate;
+// Width and height to use when resizing the image to make a descriptor for it
+const int resizeW = Config.resizeW, resizeH = Config.resizeH;
+
+// Opens a video to make descriptors of its frames with the given backend. For the luma one (if Config says so) the
+// capture is asked to skip the conversion to BGR.
+bool openCapture(VideoCapture &cap, const String &videoPath, DescriptorBackend backend) {
+    if(!cap.open(videoPath)) {return false;}
+    if(backend == DESCRIPTOR_LUMA_AREA && Config.rawLumaDecode) {cap.set(CAP_PROP_CONVERT_RGB, 0);}
+    return true;
+}
+
+// Decodes frames [begin, end) of an already opened capture, which has to be sitting at frame 'begin', and converts
+// the sampled ones (i % sampleRate == 0) into convertedFrames[i/sampleRate - firstSlot]. If 'seam' isn't null, the
+// descriptors of the seam->size() sampled frames from seamFrame on (which starts somewhere in [begin, end]) also go
+// into it, decoding past the range as far as it takes: that's what the range after this one gets checked against.
+// Returns the frames it got through (not counting the ones past the range).
+unsigned long decodeSampledRange(VideoCapture &cap, unsigned long begin, unsigned long end,
+        std::vector<Mat> &convertedFrames, DescriptorBackend backend, unsigned long firstSlot = 0,
+        unsigned long seamFrame = 0, std::vector<Mat> *seam = nullptr) {
+    unsigned long seamEnd = seam == nullptr ? 0 : seamFrame + seam->size()*sampleRate;
+    // 'original' and the describer's buffers get reused for every frame of the range
+    Mat original;
+    FrameDescriber describer(backend, resizeW, resizeH);
+    int frameHeight = (int)cap.get(CAP_PROP_FRAME_HEIGHT);
+    unsigned long i = begin, retrieved = 0;
+    for(; i < end; i++) {
+        if(!cap.grab()) {break;}
+        // Retrieve only every sampleRate (10) frames (starting with the first)
+        if (i % sampleRate != 0) { continue; }
+        cap.retrieve(original);
+        describer.describe(original, convertedFrames[i/sampleRate - firstSlot], frameHeight);
+        if(i >= seamFrame && i < seamEnd) {
+            convertedFrames[i/sampleRate - firstSlot].copyTo((*seam)[(i - seamFrame)/sampleRate]);
+        }
+        retrieved++;
+    }
+    StageCounters &counters = instruments().stage(STAGE_VIDEO_TO_DESCRIPTOR);
+    counters.framesDecoded += i - begin;
+    unsigned long decoded = i - begin;
+    // Past the range only as far as the seam goes, and only if the range got all the way through
+    if(i == end) {
+        for(; i < seamEnd && cap.grab(); i++) {
+            counters.framesDecoded++;
+            if(i % sampleRate != 0) {continue;}
+            cap.retrieve(original);
+            describer.describe(original, (*seam)[(i - seamFrame)/sampleRate], frameHeight);
+            retrieved++;
+        }
+    }
+    counters.framesRetrieved += retrieved;
+    return decoded;
+}
+
+// Opens the video on its own, seeks to frame 'seekFrom' and grabs its way from there to 'begin' (without converting
+// anything), then decodes frames [begin, end) (see decodeSampledRange). The position read back after seeking is just
+// the one we asked for on most backends, not where the decoder really landed, so all this can tell is when the
+// backend can't seek at all: then it returns false without touching anything. Whether the first frame really is
+// 'begin' has to be checked by the caller (see sameDescriptors).
+bool decodeSampledRange(const String &videoPath, unsigned long seekFrom, unsigned long begin, unsigned long end,
+        std::vector<Mat> &convertedFrames, DescriptorBackend backend, unsigned long firstSlot = 0,
+        unsigned long seamFrame = 0, std::vector<Mat> *seam = nullptr) {
+    VideoCapture cap;
+    if(!openCapture(cap, videoPath, backend)) {return false;}
+    if(seekFrom > 0) {
+        cap.set(CAP_PROP_POS_FRAMES, (double)seekFrom);
+        if((unsigned long)cap.get(CAP_PROP_POS_FRAMES) != seekFrom) {return false;}
+    }
+    unsigned long skipped = seekFrom;
+    while(skipped < begin && cap.grab()) {skipped++;}
+    instruments().stage(STAGE_VIDEO_TO_DESCRIPTOR).framesDecoded += skipped - seekFrom;
+    if(skipped == begin) {decodeSampledRange(cap, begin, end, convertedFrames, backend, firstSlot, seamFrame, seam);}
+    cap.release();
+    return true;
+}
+
+// Whether two descriptors have the very same pixels (e.g. one frame decoded after a seek, and front to back)
+bool sameDescriptor(const Mat &a, const Mat &b) {
+    if(a.empty() || b.empty()) {return a.empty() && b.empty();}
+    if(a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) {return false;}
+    size_t rowBytes = (size_t)a.cols*a.elemSize();
+    for(int r = 0; r < a.rows; r++) {
+        if(std::memcmp(a.ptr<uchar>(r), b.ptr<uchar>(r), rowBytes) != 0) {return false;}
+    }
+    return true;
+}
+
+// Whether 'count' descriptors from 'a' on have the very same pixels as the ones from 'b' on
+bool sameDescriptors(const Mat *a, const Mat *b, unsigned long count) {
+    for(unsigned long i = 0; i < count; i++) {
+        if(!sameDescriptor(a[i], b[i])) {return false;}
+    }
+    return true;
+}
+
+// Whether a run of descriptors can tell a seek that landed right from one a few frames off: not if it's too short
+// or all the same frame, which would look the same wherever it started (any of them empty counts as that too)
+bool distinctiveDescriptors(const Mat *frames, unsigned long count) {
+    if(count < 2) {return false;}
+    bool allSame = true;
+    for(unsigned long i = 0; i < count; i++) {
+        if(frames[i].empty()) {return false;}
+        allSame = allSame && sameDescriptor(frames[0], frames[i]);
+    }
+    return !allSame;
+}
+
+// Converts the given video file to a descriptor of it (in this case a vector of resized and grayscaled frames, made
+// with the given backend) returns the vector with the converted frames, total frames the original video has and its
+// duration in ms.
+// With threads != 1 (0 = all cores) the video is cut into that many frame ranges (but none shorter than
+// minSampledPerRange sampled frames), each one decoded by its own VideoCapture. Ranges start at multiples of
+// sampleRate, so the sampled frames are exactly the serial ones, as long as the seeks land where they were asked to.
+// On GOP encoded video they don't always (a seek goes to a keyframe and the backend works out the frame number from
+// there), so every range's first Config.seekCheckFrames sampled frames are checked against the same frames decoded by
+// the range before it, going on from its own start. A range that doesn't match, or whose first frames are all the
+// same (so they can't tell), is decoded again from the start of the last one that did, going through the frames in
+// between.
+// Gives back no frames (and 0 total frames) if the video can't be opened or the backend can't tell how many frames
+// it has.
+std::tuple<std::vector<Mat>, double, long double> videoToDescriptor(const String &videoPath, bool verbose,
+        int threads, DescriptorBackend backend, unsigned long minSampledPerRange) {
+    StageTimer timer(STAGE_VIDEO_TO_DESCRIPTOR);
+    instruments().stage(STAGE_VIDEO_TO_DESCRIPTOR).bytesRead += fileBytes(videoPath);
+    VideoCapture cap;
+    if(!openCapture(cap, videoPath, backend)) {
+        std::cerr << "ERROR: Couldn't open " << videoPath << std::endl;
+        return std::make_tuple(std::vector<Mat>(), 0.0, (long double)0);
+    }
+    double frameCount = cap.get(CAP_PROP_FRAME_COUNT);   // gives them as double
+    auto totalFrames = frameCount > 0 ? (unsigned long)frameCount : 0UL;
+    if(totalFrames == 0) {
+        std::cerr << "ERROR: Couldn't tell how many frames " << videoPath << " has" << std::endl;
+        return std::make_tuple(std::vector<Mat>(), 0.0, (long double)0);
+    }
+    // Amount of frames we are going to use from the video (so we can do the following fixed size initialization)
+    unsigned long sampledLength = amountSampled(totalFrames, sampleRate);
+    // Vector where we'll store all converted frames
+    std::vector<Mat> convertedFrames(sampledLength);
+    if(verbose) {
+        std::cout << "Processing " << videoPath << ". Total frames: " << totalFrames <<
+                  ". Sampled frames: " << sampledLength << std::flush;
+    }
+    if(threads <= 0) {threads = hardwareThreads();}
+    // Not worth a seek per range on short videos (i.e. the ads)
+    unsigned long ranges = std::min((unsigned long)threads, sampledLength/std::max(minSampledPerRange, 1UL));
+    bool decoded = false;
+    if(ranges > 1) {
+        // Range boundaries in sampled frames, turned into real frames when decoding
+        unsigned long sampledPerRange = (sampledLength + ranges - 1)/ranges;
+        auto rangeFirst = [&](unsigned long range) {return std::min(range*sampledPerRange*sampleRate, totalFrames);};
+        // How many of a range's first sampled frames its seek gets checked on
+        auto headCount = [&](unsigned long range) {
+            unsigned long first = rangeFirst(range), last = rangeFirst(range + 1);
+            return last > first ? std::min(Config.seekCheckFrames, amountSampled(last - first, sampleRate)) : 0UL;
+        };
+        std::vector<char> rangeOk(ranges, 0);
+        // seams[range] is the head of range + 1, as decoded going on from 'range'
+        std::vector<std::vector<Mat>> seams(ranges);
+        for(unsigned long range = 0; range + 1 < ranges; range++) {seams[range].resize(headCount(range + 1));}
+        ThreadPool pool((int)ranges);
+        // Each range writes its own slots of convertedFrames, so they can all go at the same time
+        pool.parallelFor(ranges, 1, [&](unsigned long begin, unsigned long end) {
+            for(unsigned long range = begin; range < end; range++) {
+                unsigned long first = rangeFirst(range), last = rangeFirst(range + 1);
+                rangeOk[range] = decodeSampledRange(videoPath, first, first, last, convertedFrames, backend, 0, last,
+                                                    range + 1 < ranges ? &seams[range] : nullptr);
+            }
+        });
+        decoded = std::find(rangeOk.begin(), rangeOk.end(), 0) == rangeOk.end();
+        if(!decoded) {
+            std::cerr << "\nWARNING: Couldn't seek in " << videoPath << ", decoding it front to back instead"
+                      << std::endl;
+        }
+        // In order, since a range can only be checked against one that's already known to be right (the first one
+        // always is, it doesn't seek)
+        unsigned long goodSeek = 0, redone = 0;
+        for(unsigned long range = 1; decoded && range < ranges; range++) {
+            unsigned long first = rangeFirst(range), last = rangeFirst(range + 1);
+            const Mat *head = &convertedFrames[std::min(first/sampleRate, sampledLength - 1)];
+            if(first >= totalFrames || (distinctiveDescriptors(head, headCount(range)) &&
+                                        sameDescriptors(head, seams[range - 1].data(), headCount(range)))) {
+                goodSeek = first;
+                continue;
+            }
+            redone++;
+            decoded = decodeSampledRange(videoPath, goodSeek, first, last, convertedFrames, backend, 0, last,
+                                         range + 1 < ranges ? &seams[range] : nullptr);
+        }
+        if(redone > 0 && verbose) {
+            std::cout << ". Seeks landed off (or couldn't be checked) in " << redone << " of " << ranges
+                      << " ranges, decoded again"
+                      << std::flush;
+        }
+    }
+    if(!decoded) {
+        // Sampling frames from the video and converting them into a more descriptor(ish) form:
+        decodeSampledRange(cap, 0, totalFrames, convertedFrames, backend);
+    }
+    long double duration;
+    // Go to after the last frame.
+    cap.set(CAP_PROP_POS_AVI_RATIO, 1);
+    duration = cap.get(CAP_PROP_POS_MSEC);
+    cap.release();
+    if(verbose) {std::cout << ". Duration (ms): " << duration << std::endl;}
+    return std::make_tuple(convertedFrames, totalFrames, duration);
+}
+
+
+
+// Makes the descriptors of a video with both backends and compares them pixel by pixel (see DescriptorParity)
+bool compareDescriptorBackends(const String &videoPath, DescriptorBackend reference, DescriptorBackend candidate,
+        DescriptorParity &parity, int threads) {
+    parity = DescriptorParity();
+    parity.reference = reference;
+    parity.candidate = candidate;
+    std::vector<Mat> referenceFrames, candidateFrames;
+    double totalFrames;
+    long double duration;
+    auto start = std::chrono::steady_clock::now();
+    std::tie(referenceFrames, totalFrames, duration) = videoToDescriptor(videoPath, false, threads, reference);
+    parity.referenceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    std::tie(candidateFrames, totalFrames, duration) = videoToDescriptor(videoPath, false, threads, candidate);
+    parity.candidateSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(referenceFrames.size() != candidateFrames.size()) {
+        std::cerr << "ERROR: The backends got " << referenceFrames.size() << " and " << candidateFrames.size()
+                  << " frames out of " << videoPath << std::endl;
+        return false;
+    }
+    parity.frames = referenceFrames.size();
+    unsigned long frameSize = (unsigned long)resizeW*resizeH, pixels = 0, over8 = 0;
+    double absSum = 0, distSum = 0;
+    for(unsigned long i = 0; i < parity.frames; i++) {
+        // Frames past the end of a video that reported more frames than it had are left empty by both backends
+        if(referenceFrames[i].empty() || candidateFrames[i].empty()) {continue;}
+        const uchar *a = referenceFrames[i].ptr<uchar>(0), *b = candidateFrames[i].ptr<uchar>(0);
+        for(unsigned long px = 0; px < frameSize; px++) {
+            int diff = std::abs((int)a[px] - (int)b[px]);
+            absSum += diff;
+            over8 += diff > 8;
+            parity.maxAbsDiff = std::max(parity.maxAbsDiff, diff);
+        }
+        distSum += squaredL2(a, b, (int)frameSize);
+        pixels += frameSize;
+    }
+    if(pixels > 0) {
+        parity.meanAbsDiff = absSum/pixels;
+        parity.pixelsOver8 = (double)over8/pixels;
+        parity.meanFrameDistance = distSum/(pixels/frameSize);
+    }
+    return true;
+}
+
+// Writes compareDescriptorBackends' numbers for the original backend against the luma one, on the given video.
+// meanFrameDistance is in the same units as the nearest frame distances, so it can be held against those.
+int descriptorParityReport(const String &videoPath, const String &reportPath, bool verbose) {
+    DescriptorParity parity;
+    if(!compareDescriptorBackends(videoPath, DESCRIPTOR_BGR_CUBIC, DESCRIPTOR_LUMA_AREA, parity,
+                                  Config.decodeThreads)) {return -1;}
+    std::ofstream report(reportPath);
+    report << "# " << extractNameFromPath(videoPath) << ": " << parity.frames << " sampled frames, "
+           << resizeW << "x" << resizeH << " descriptors\n";
+    report << "reference\tcandidate\treferenceSeconds\tcandidateSeconds\tspeedup\tmeanAbsDiff\tmaxAbsDiff\t"
+              "pixelsOver8\tmeanFrameDistance\n";
+    report << descriptorBackendName(parity.reference) << '\t' << descriptorBackendName(parity.candidate) << '\t'
+           << parity.referenceSeconds << '\t' << parity.candidateSeconds << '\t'
+           << (parity.candidateSeconds > 0 ? parity.referenceSeconds/parity.candidateSeconds : 0) << '\t'
+           << parity.meanAbsDiff << '\t' << parity.maxAbsDiff << '\t' << parity.pixelsOver8 << '\t'
+           << parity.meanFrameDistance << '\n';
+    report.close();
+    if(verbose) {std::cout << "Descriptor parity report saved in:\n\t" << reportPath << std::endl;}
+    return 1;
+}
+
+// Opens the ad library and makes sure its descriptors are the size we're making ours
+bool openAdLibrary(AdLibrary &library, const String &adLibraryPath) {
+    if(!library.open(adLibraryPath)) {return false;}
+    if(library.frameW() != (uint32_t)resizeW || library.frameH() != (uint32_t)resizeH) {
+        std::cerr << "ERROR: " << adLibraryPath << " holds " << library.frameW() << "x" << library.frameH()
+                  << " descriptors, expected " << resizeW << "x" << resizeH << std::endl;
+        return false;
+    }
+    if(library.descriptorBackend() != (uint32_t)Config.descriptorBackend) {
+        std::cerr << "ERROR: " << adLibraryPath << " holds "
+                  << descriptorBackendName((DescriptorBackend)library.descriptorBackend()) << " descriptors, expected "
+                  << descriptorBackendName(Config.descriptorBackend) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Writes the descriptors of one video in the old text format: a "[sampled] [total frames] [duration]" header line,
+// then one line of space separated pixel values per sampled frame. 'frames' are packed back to back.
+bool writeDescriptorTextFile(const String &outFilePath, const uchar *frames, unsigned long sampledLength,
+        double totalFrames, long double duration) {
+    unsigned long frameSize = (unsigned long)resizeW*resizeH;
+    std::ofstream outFile(outFilePath);
+    // First line is "[number of used frames] [number of frames in the original video] [duration]"
+    outFile << sampledLength << ' ' << totalFrames << ' ' << duration << '\n';
+    for(unsigned long i = 0; i < sampledLength; i++) {
+        const uchar *current = frames + i*frameSize;
+        // Each row is the space separated pixel values of the frame
+        for(unsigned long px = 0; px < frameSize; px++) {
+            outFile << (int)current[px];
+            // Add as space as separate, except if we reached the end.
+            if(px != frameSize - 1) {outFile << ' ';}
+        }
+        outFile << '\n';
+    }
+    outFile.close();
+    return (bool)outFile;
+}
+
+// Takes all video files in the given input folder, with the given extension, and packs the descriptors of all of
+// them into a single binary ad library (see adlibrary.h). It summarizes all the information in a directory file.
+// If textExportFolder isn't empty, a .txt file of descriptors per ad is also written there (the old format).
+// Ads are decoded 'threads' at a time (0 = one per core).
+// The library is updated incrementally: a manifest next to it (see manifest.h) remembers the size, modification
+// time and content hash of every source video, plus the sampling settings. Ads whose file didn't change are copied
+// over from the current library, only new or changed ones get decoded, and deleted ones are dropped (along with
+// their text export and the library's index).
+int makeVideoDescriptorFiles (const String &inputFolder, const String &extension,
+        const String &libraryPath, const String &directoryPath, bool verbose,
+        const String &textExportFolder, int threads) {
+    StageTimer timer(STAGE_BUILD_LIBRARY);
+    std::vector<String> videoPaths;
+    String pattern = inputFolder + "/*." + extension;
+    // Assumes all relevant files are at the first level of the given directory, so set recursion to false.
+    glob(pattern, videoPaths, false);
+
+    // What's in the library already, if it was made with the settings we have now
+    LibraryManifest oldManifest;
+    AdLibrary oldLibrary;
+    std::unordered_map<std::string, uint32_t> oldAds;
+    bool haveOld = oldManifest.read(manifestPath(libraryPath)) && oldManifest.sampleRate == sampleRate &&
+                   oldManifest.resizeW == resizeW && oldManifest.resizeH == resizeH &&
+                   oldManifest.descriptorBackend == (int)Config.descriptorBackend &&
+                   std::ifstream(libraryPath).good() && openAdLibrary(oldLibrary, libraryPath);
+    if(haveOld) {
+        for(uint32_t i = 0; i < oldLibrary.adCount(); i++) {oldAds[oldLibrary.name(i)] = i;}
+    }
+    LibraryManifest manifest;
+    manifest.sampleRate = sampleRate;
+    manifest.resizeW = resizeW;
+    manifest.resizeH = resizeH;
+    manifest.descriptorBackend = (int)Config.descriptorBackend;
+    // Which ads can be copied from the old library: same size and mtime, or failing that, same contents
+    std::vector<char> reuse(videoPaths.size(), 0);
+    std::vector<unsigned long> toExtract;
+    for(unsigned long i = 0; i < videoPaths.size(); i++) {
+        ManifestEntry entry;
+        entry.name = extractNameFromPath(videoPaths[i]);
+        entry.path = videoPaths[i];
+        entry.hash = 0;
+        if(!fileStat(entry.path, entry.size, entry.mtime)) {
+            std::cerr << "ERROR: Couldn't stat " << entry.path << std::endl;
+            return -1;
+        }
+        const ManifestEntry *old = haveOld ? oldManifest.find(entry.path) : nullptr;
+        bool inOldLibrary = old != nullptr && old->name == entry.name && oldAds.count(entry.name) > 0;
+        if(inOldLibrary && old->size == entry.size && old->mtime == entry.mtime) {
+            entry.hash = old->hash;
+            reuse[i] = 1;
+        }
+        else {
+            // A file we can't read would go in with hash 0 (and could even match an old entry), so that's an error
+            if(!hashFile(entry.path, entry.hash)) {
+                std::cerr << "ERROR: Couldn't read " << entry.path << std::endl;
+                return -1;
+            }
+            reuse[i] = inOldLibrary && old->hash == entry.hash;
+        }
+        if(!reuse[i]) {toExtract.push_back(i);}
+        manifest.entries.push_back(entry);
+    }
+    // Ads in the old library that aren't in the folder anymore
+    std::vector<std::string> removed;
+    for(auto &oldAd: oldAds) {
+        bool stillThere = false;
+        for(const ManifestEntry &entry: manifest.entries) {stillThere = stillThere || entry.name == oldAd.first;}
+        if(!stillThere) {removed.push_back(oldAd.first);}
+    }
+    if(verbose) {
+        std::cout << videoPaths.size() << " ads: " << (videoPaths.size() - toExtract.size()) << " unchanged, "
+                  << toExtract.size() << " new or changed, " << removed.size() << " removed" << std::endl;
+    }
+    bool libraryChanged = !haveOld || !toExtract.empty() || !removed.empty();
+
+    AdLibraryBuilder library(sampleRate, resizeW, resizeH, (uint32_t)Config.descriptorBackend);
+    unsigned long frameSize = (unsigned long)resizeW*resizeH;
+    // Every ad to extract gets decoded by its own worker (each with its own VideoCapture). The results are then
+    // saved in glob order, so the library comes out the same no matter how many threads there were.
+    struct ExtractedAd {
+        std::vector<Mat> convertedFrames;
+        double totalFrames;
+        long double duration;
+    };
+    std::vector<ExtractedAd> extracted(videoPaths.size());
+    if(!toExtract.empty()) {
+        ThreadPool pool(threads);
+        if(verbose) {std::cout << "Extracting " << toExtract.size() << " ads with " << pool.size() << " threads\n";}
+        pool.parallelFor(toExtract.size(), 1, [&](unsigned long begin, unsigned long end) {
+            for(unsigned long i = begin; i < end; i++) {
+                ExtractedAd &ad = extracted[toExtract[i]];
+                std::tie(ad.convertedFrames, ad.totalFrames, ad.duration) =
+                        videoToDescriptor(videoPaths[toExtract[i]], false);
+            }
+        });
+        // An ad that couldn't be decoded (or only part of the way) can't go in the library with made up frames
+        for(unsigned long i: toExtract) {
+            const std::vector<Mat> &frames = extracted[i].convertedFrames;
+            bool complete = !frames.empty();
+            for(const Mat &frame: frames) {complete = complete && !frame.empty();}
+            if(!complete) {
+                std::cerr << "ERROR: Couldn't decode ad " << videoPaths[i] << std::endl;
+                return -1;
+            }
+        }
+    }
+    // Directory of ads and their very general info:
+    std::ofstream directoryFile(directoryPath);
+    std::vector<uchar> packedFrames;
+    for(unsigned long adInd = 0; adInd < videoPaths.size(); adInd++) {
+        String videoName = manifest.entries[adInd].name;
+        double totalFrames;
+        long double duration;
+        unsigned long sampledLength;
+        if(reuse[adInd]) {
+            uint32_t oldAd = oldAds[videoName];
+            const AdLibraryEntry &oldEntry = oldLibrary.entry(oldAd);
+            totalFrames = (double)oldEntry.totalFrames;
+            duration = oldEntry.duration;
+            sampledLength = oldEntry.sampledFrames;
+            library.addAd(videoName, oldEntry.totalFrames, oldEntry.duration, oldLibrary.adFrame(oldAd, 0),
+                          sampledLength, oldLibrary.frameStride());
+            // With the library as it was, its text export only needs writing if it went missing
+            bool exported = textExportFolder.empty() ||
+                            (!libraryChanged && std::ifstream(textExportFolder + "/" + videoName + ".txt").good());
+            if(exported) {
+                directoryFile << videoName << '\n' << totalFrames << ' ' << duration << '\n';
+                continue;
+            }
+            // Text export of a reused ad: unpad the old library's frames
+            packedFrames.resize(sampledLength*frameSize);
+            for(unsigned long i = 0; i < sampledLength; i++) {
+                std::memcpy(&packedFrames[i*frameSize], oldLibrary.adFrame(oldAd, i), frameSize);
+            }
+        }
+        else {
+            std::vector<Mat> &convertedFrames = extracted[adInd].convertedFrames;
+            totalFrames = extracted[adInd].totalFrames;
+            duration = extracted[adInd].duration;
+            sampledLength = convertedFrames.size();
+            if(verbose) {
+                std::cout << "Processed " << videoPaths[adInd] << ". Total frames: " << totalFrames
+                          << ". Sampled frames: " << sampledLength << ". Duration (ms): " << duration << '\n';
+            }
+            // convertedFrames now holds all of every 10 frames from the video, in grayscale in resized to 16x16
+            packedFrames.resize(sampledLength*frameSize);
+            for(unsigned long i = 0; i < sampledLength; i++) {
+                // resize() always hands back a continuous Mat, so the pixels are already row-major and back to back
+                std::memcpy(&packedFrames[i*frameSize], convertedFrames[i].ptr<uchar>(0), frameSize);
+            }
+            library.addAd(videoName, (uint64_t)totalFrames, (double)duration, packedFrames.data(), sampledLength);
+            // Done with this one, no need to keep its frames around while packing the rest
+            std::vector<Mat>().swap(convertedFrames);
+        }
+        // Save info in directory (to be used at the end of the whole process)
+        directoryFile << videoName << '\n' << totalFrames << ' ' << duration << '\n';
+        if(!textExportFolder.empty()) {
+            String outFilePath = textExportFolder + "/" + videoName  + ".txt";
+            if(!writeDescriptorTextFile(outFilePath, packedFrames.data(), sampledLength, totalFrames, duration)) {
+                std::cerr << "ERROR: Couldn't save descriptors for " << videoName << std::endl;
+                return -1;
+            }
+            if(verbose){std::cout << "\tText descriptors saved in:\n\t\t" << outFilePath  << "\n\n";}
+        }
+    }
+    directoryFile.close();
+    if(libraryChanged) {
+        if(!library.write(libraryPath)) {return -1;}
+        // Whatever index there was is for the old library
+        std::remove(vpTreePath(libraryPath).c_str());
+        std::remove(compactIndexPath(libraryPath).c_str());
+        for(const std::string &name: removed) {
+            if(!textExportFolder.empty()) {std::remove((textExportFolder + "/" + name + ".txt").c_str());}
+        }
+    }
+    // Even with the same library, mtimes (or hashes of touched files) might be new
+    if(!manifest.write(manifestPath(libraryPath))) {return -1;}
+    if(verbose) {
+        std::cout << "All videos have been processed \\o/" << '\n';
+        if(libraryChanged) {
+            std::cout << "Ad library (" << library.adCount() << " ads) saved in:\n\t" << libraryPath << '\n';
+        }
+        else {std::cout << "Ad library was already up to date:\n\t" << libraryPath << '\n';}
+        std::cout << "Directory of processed videos saved in:\n\t"
+                  << directoryPath << "\n\t(Format is: [name] [total frames] [duration])" << std::endl;
+    }
+    return 1;
+}
+// Read file with descriptors, return a vector of frame descriptors of the form
+DescriptorContainer readDescriptors(const String &filePath) {
+    StageTimer timer(STAGE_READ_DESCRIPTORS);
+    // Thaanks https://stackoverflow.com/a/9571913/4192226
+    std::ifstream file(filePath);
+    std::string line;
+    // Read header line
+    std::getline(file, line);
+    unsigned long sampledFrames; long totalFrames; double duration;
+    std::stringstream lineStream(line);
+    lineStream >> sampledFrames >> totalFrames >> duration;
+    // Reading frames:
+    unsigned long frameSize = (unsigned long)resizeW*resizeH;
+    std::vector<std::vector<int>> adFrames(sampledFrames, std::vector<int>(frameSize));
+    for(unsigned long currentFrame = 0; currentFrame < sampledFrames; currentFrame ++){
+        std::getline(file, line);
+        lineStream = std::stringstream(line);
+        int value;
+        // Read an integer at a time from the line
+        for(unsigned long i = 0; i < frameSize; i ++){
+            lineStream >> value;
+            adFrames[currentFrame][i] = value;
+        }
+    }
+    StageCounters &counters = instruments().stage(STAGE_READ_DESCRIPTORS);
+    counters.bytesRead += fileBytes(filePath);
+    counters.framesRetrieved += sampledFrames;
+    return std::make_tuple(adFrames, totalFrames, duration);
+}
+
+// videoToDescriptor, but with the frames packed into one aligned matrix (same as the ads' ones are in the library)
+FrameMatrix videoToFrameMatrix(const String &videoPath, double &totalFrames, long double &duration,
+        bool verbose) {
+    // Vector of Mats representing a frame that's been converted into a descriptor (Gray, resized)
+    std::vector<Mat> videoDescriptors;
+    std::tie(videoDescriptors, totalFrames, duration) = videoToDescriptor(videoPath, verbose, Config.decodeThreads);
+    FrameMatrix videoFrames(videoDescriptors.size(), resizeW*resizeH);
+    for(unsigned long i = 0; i < videoDescriptors.size(); i++) {
+        videoFrames.setRow(i, videoDescriptors[i]);
+    }
+    return videoFrames;
+}
+
+// fnv1a64 of the pixels of 'count' descriptors from 'descriptors' on, 0 if any of them is empty
+static uint64_t descriptorsHash(const Mat *descriptors, unsigned long count) {
+    uint64_t hash = FNV1A64_INIT;
+    for(unsigned long i = 0; i < count; i++) {
+        if(descriptors[i].empty()) {return 0;}
+        for(int r = 0; r < descriptors[i].rows; r++) {
+            hash = fnv1a64(descriptors[i].ptr<uchar>(r), (size_t)descriptors[i].cols*descriptors[i].elemSize(), hash);
+        }
+    }
+    return hash;
+}
+
+// Sampled frames [beginSampled, endSampled) of a video packed into videoFrames the same way (e.g. one shard of it,
+// see shard.h). Seeks to sampled frame seekFromSampled and decodes its way from there, or from the start if the
+// backend can't seek. Like with videoToDescriptor's ranges, the seek can land off on GOP encoded video, and that's
+// for the caller to find out: headHash gets the descriptorsHash of the first headLength sampled frames (headDistinct
+// whether they could tell a seek that landed off at all, see distinctiveDescriptors), and seamHash the one of the
+// seamLength sampled frames from seamSampled (in [beginSampled, endSampled]) on, decoding past the range if it takes,
+// to be held against what other ranges got for the same frames.
+// False when the video can't be opened or the decoding stops before getting all of those frames.
+bool videoRangeToFrameMatrix(const String &videoPath, unsigned long seekFromSampled, unsigned long beginSampled,
+        unsigned long endSampled, unsigned long headLength, unsigned long seamSampled, unsigned long seamLength,
+        FrameMatrix &videoFrames, uint64_t &headHash, bool &headDistinct, uint64_t &seamHash, bool verbose) {
+    StageTimer timer(STAGE_VIDEO_TO_DESCRIPTOR);
+    unsigned long totalFrames;
+    double duration, fps;
+    probeVideo(videoPath, totalFrames, duration, fps);
+    unsigned long totalSampled = totalFrames > 0 ? amountSampled(totalFrames, sampleRate) : 0;
+    if(beginSampled >= endSampled || endSampled > totalSampled || seamSampled < beginSampled ||
+       seamSampled > endSampled || seamSampled + seamLength > totalSampled) {
+        std::cerr << "ERROR: Can't decode sampled frames " << beginSampled << " to " << endSampled << " of "
+                  << videoPath << " (" << totalSampled << " sampled frames)" << std::endl;
+        return false;
+    }
+    unsigned long first = beginSampled*sampleRate;
+    unsigned long last = std::min(endSampled*sampleRate, totalFrames);
+    unsigned long seekFrom = std::min(seekFromSampled*sampleRate, first);
+    std::vector<Mat> convertedFrames(endSampled - beginSampled), seam(seamLength);
+    if(verbose) {
+        std::cout << "Processing sampled frames " << beginSampled << " to " << endSampled << " of " << videoPath
+                  << std::endl;
+    }
+    if(!decodeSampledRange(videoPath, seekFrom, first, last, convertedFrames, Config.descriptorBackend,
+                           beginSampled, seamSampled*sampleRate, &seam) &&
+       !decodeSampledRange(videoPath, 0, first, last, convertedFrames, Config.descriptorBackend, beginSampled,
+                           seamSampled*sampleRate, &seam)) {
+        std::cerr << "ERROR: Couldn't open " << videoPath << std::endl;
+        return false;
+    }
+    headLength = std::min(headLength, (unsigned long)convertedFrames.size());
+    headHash = descriptorsHash(convertedFrames.data(), headLength);
+    headDistinct = distinctiveDescriptors(convertedFrames.data(), headLength);
+    seamHash = descriptorsHash(seam.data(), seam.size());
+    if(descriptorsHash(convertedFrames.data(), convertedFrames.size()) == 0 || seamHash == 0) {
+        std::cerr << "ERROR: Decoding " << videoPath << " stopped before sampled frame "
+                  << std::max(endSampled, seamSampled + seamLength) << std::endl;
+        return false;
+    }
+    videoFrames = FrameMatrix(convertedFrames.size(), resizeW*resizeH);
+    for(unsigned long i = 0; i < convertedFrames.size(); i++) {videoFrames.setRow(i, convertedFrames[i]);}
+    return true;
+}
+
+// The search settings in Config
+SearchOptions searchOptionsFromConfig() {
+    SearchOptions options;
+    options.mode = Config.searchMode;
+    options.threads = Config.searchThreads;
+    options.chunkSize = Config.searchChunkSize;
+    options.leafSize = Config.indexLeafSize;
+    options.maxChecks = Config.indexMaxChecks;
+    options.compactDims = Config.compactDims;
+    options.shortlist = Config.compactShortlist;
+    options.guideWindow = Config.guideWindow;
+    return options;
+}
+
+// The nearest ad frame of every row of videoFrames, on options.threads threads. Counters go into 'stats'.
+std::vector<FrameMatch> searchNearestFrames(const NearestFrameSearcher &searcher, const FrameMatrix &videoFrames,
+        const SearchOptions &options, SearchStats &stats, bool verbose) {
+    unsigned long totalSampled = videoFrames.rows();
+    std::vector<FrameMatch> nearestFrames(totalSampled);
+    // Let's start iterating over all the converted frames of the video:
+    if(verbose){
+        std::cout << "Finding nearest frames! (distance kernel: "
+                  << (options.mode == SEARCH_BATCHED ? batchedKernel() : squaredL2KernelFor(videoFrames.rowLength()))
+                  << ")\n";
+    }
+    // Chunks of consecutive frames go to the searcher together, so the batched mode gets whole blocks of queries
+    unsigned long chunkSize = std::max(options.chunkSize, 1UL);
+    if(options.threads == 1) {
+        for(unsigned long begin = 0; begin < totalSampled; begin += chunkSize) {
+            unsigned long end = std::min(totalSampled, begin + chunkSize);
+            if(verbose && (begin/1000) != (end/1000)) {
+                std::cout << "Current sampled video frame: " << end << std::endl;
+            }
+            searcher.findBlock(videoFrames.row(begin), end - begin, videoFrames.stride(), &nearestFrames[begin],
+                               &stats);
+        }
+    }
+    else {
+        // Every video frame is independent, so chunks of them go to the pool. Each frame's result has its own
+        // slot in nearestFrames, so no locking is needed and the output is the same as the serial loop's.
+        ThreadPool pool(options.threads);
+        if(verbose){std::cout << "Using " << pool.size() << " threads" << std::endl;}
+        std::atomic<unsigned long> framesDone(0);
+        std::mutex statsMutex;
+        pool.parallelFor(totalSampled, chunkSize, [&](unsigned long begin, unsigned long end) {
+            SearchStats chunkStats;
+            searcher.findBlock(videoFrames.row(begin), end - begin, videoFrames.stride(), &nearestFrames[begin],
+                               &chunkStats);
+            {
+                std::lock_guard<std::mutex> lock(statsMutex);
+                stats.add(chunkStats);
+            }
+            unsigned long before = framesDone.fetch_add(end - begin);
+            if(verbose && (before/1000) != ((before + end - begin)/1000)) {
+                std::cout << "Sampled video frames done: " << (before + end - begin) << std::endl;
+            }
+        });
+    }
+    StageCounters &counters = instruments().stage(STAGE_FIND_NEAREST_FRAMES);
+    counters.framesSearched += totalSampled;
+    counters.distances += stats.distances;
+    if(verbose){
+        std::cout << "Search: ";
+        stats.print(std::cout);
+    }
+    return nearestFrames;
+}
+
+// Writes the nearest frames file that detectAds reads: the binary one (see nearestframes.h), or the old text one
+// with every ad name and frame number on their own lines
+bool writeNearestFramesFile(const String &outFilePath, const String &videoName, double totalFrames,
+        long double duration, const std::vector<FrameMatch> &nearestFrames, const AdLibrary &library, bool binary) {
+    std::vector<std::string> adNames(library.adCount());
+    for(uint32_t i = 0; i < library.adCount(); i++) {
+        adNames[i] = library.name(i);
+    }
+    if(binary) {
+        std::vector<NearestFrameRecord> records(nearestFrames.size());
+        for(unsigned long i = 0; i < nearestFrames.size(); i++) {
+            records[i].ad = nearestFrames[i].ad;
+            records[i].adFrame = nearestFrames[i].adFrame + 1;
+            records[i].dist = (uint32_t)std::min<long>(nearestFrames[i].dist, UINT32_MAX);
+        }
+        return writeNearestFramesBinary(outFilePath, videoName, (uint64_t)totalFrames, (double)duration, sampleRate,
+                                        resizeW, resizeH, adNames, records);
+    }
+    std::ofstream outFile(outFilePath);
+    // First the title of the video:
+    outFile << videoName << '\n';
+    // Then a header which contains the long video's general info (total number of frames, and duration)
+    outFile << totalFrames << ' ' << duration << '\n';
+    // A second header which has the sampling rate and the W and H values used in the resize
+    outFile << sampleRate << ' ' << resizeW << ' ' << resizeH << '\n';
+    // Now, for each frame of the video, record the nearest frame:
+    for(auto &nearest: nearestFrames){
+        // since the name has spaces, it's less problematic to save the name in its own line. A frame with no ad
+        // (e.g. from an empty library) gets an empty name, which detectAds doesn't find in its directory.
+        const std::string &adName = nearest.ad < adNames.size() ? adNames[nearest.ad] : std::string();
+        outFile << adName << '\n' << (nearest.adFrame + 1) << '\n';
+    }
+    outFile.close();
+    return (bool)outFile;
+}
+
+// For every frame of the given video, figures out the nearest frame from all ads to that frame of the video.
+// The ads come from the binary library written by makeVideoDescriptorFiles, which is mapped and used in place.
+// How the search is done (exhaustive or through an index, how many threads) comes from 'options'.
+void findNearestFrames(const String &videoPath, const String &outFilePath,
+        const String &adLibraryPath, bool verbose, const SearchOptions &options) {
+    StageTimer timer(STAGE_FIND_NEAREST_FRAMES);
+    AdLibrary library;
+    if(!openAdLibrary(library, adLibraryPath)) {return;}
+    // Mapped, but every search mode ends up going through all of it
+    instruments().stage(STAGE_FIND_NEAREST_FRAMES).bytesRead += library.fileSize();
+    NearestFrameSearcher searcher;
+    if(!searcher.prepare(library, adLibraryPath, options, verbose)) {return;}
+
+    double totalFrames;
+    long double duration;
+    FrameMatrix videoFrames = videoToFrameMatrix(videoPath, totalFrames, duration, true);
+    SearchStats stats;
+    std::vector<FrameMatch> nearestFrames = searchNearestFrames(searcher, videoFrames, options, stats, verbose);
+
+    String videoName = extractNameFromPath(videoPath);
+    if(verbose){ std::cout << "Saving nearest frames' information to:\n\t" << outFilePath << std::endl; }
+    writeNearestFramesFile(outFilePath, videoName, totalFrames, duration, nearestFrames, library,
+                           Config.binaryNearestFrames);
+    if(verbose){std::cout << "Done saving nearest frames!" << std::endl;}
+}
+
+// The exhaustive answer for every row of videoFrames, for the recall reports. Returns the seconds it took.
+static double exactNearestFrames(const AdLibrary &library, const FrameMatrix &videoFrames,
+        std::vector<FrameMatch> &exact) {
+    exact.resize(videoFrames.rows());
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned long i = 0; i < videoFrames.rows(); i++) {exact[i] = bruteForceNearest(library, videoFrames.row(i));}
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Header lines of a recall report, 'setting' being the name of the first column
+static void writeRecallHeader(std::ostream &report, const String &videoPath, const AdLibrary &library,
+        unsigned long totalSampled, double exactSeconds, const char *setting) {
+    report << "# " << extractNameFromPath(videoPath) << ": " << totalSampled << " sampled frames against "
+           << library.totalSampled() << " ad frames (" << library.adCount() << " ads)\n";
+    report << "# exhaustive scan: " << exactSeconds << " s\n";
+    report << setting << "\tavgDistances\tseconds\tspeedup\trecall\tsameAd\tmeanDistRatio\n";
+}
+
+// Runs an approximate searcher over every row of videoFrames and writes how it did against the exact answer as
+// one row of a recall report (see indexRecallReport)
+static void writeRecallRow(std::ostream &report, unsigned long setting, const NearestFrameSearcher &searcher,
+        const FrameMatrix &videoFrames, const std::vector<FrameMatch> &exact, double exactSeconds) {
+    unsigned long totalSampled = videoFrames.rows();
+    unsigned long sameFrame = 0, sameAd = 0;
+    SearchStats stats;
+    double ratioSum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned long i = 0; i < totalSampled; i++) {
+        FrameMatch found = searcher.find(videoFrames.row(i), &stats);
+        if(found.ad == exact[i].ad) {
+            sameAd++;
+            if(found.adFrame == exact[i].adFrame) {sameFrame++;}
+        }
+        ratioSum += exact[i].dist == 0 ? (found.dist == 0 ? 1.0 : 2.0) : (double)found.dist/exact[i].dist;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report << setting << '\t' << (double)stats.distances/totalSampled << '\t' << seconds << '\t'
+           << (seconds > 0 ? exactSeconds/seconds : 0) << '\t' << (double)sameFrame/totalSampled << '\t'
+           << (double)sameAd/totalSampled << '\t' << ratioSum/totalSampled << '\n';
+}
+
+// Runs the VP tree search on the given video with each of the maxChecks values and compares it against the exact
+// (brute force) answer. For every setting the report has: average distances computed per frame, time, recall
+// (same ad frame as the exact search), and the rate of frames whose nearest ad is the right one, which is the only
+// thing detectAds looks at (so that's the one that has to stay close to 1 for the detections not to change).
+int indexRecallReport(const String &videoPath, const String &adLibraryPath, const String &reportPath,
+        const std::vector<unsigned long> &maxChecksList, bool verbose) {
+    AdLibrary library;
+    if(!openAdLibrary(library, adLibraryPath)) {return -1;}
+    double totalFrames;
+    long double duration;
+    FrameMatrix videoFrames = videoToFrameMatrix(videoPath, totalFrames, duration, verbose);
+    unsigned long totalSampled = videoFrames.rows();
+    if(totalSampled == 0) {
+        std::cerr << "ERROR: No frames sampled from " << videoPath << std::endl;
+        return -1;
+    }
+    SearchOptions options = searchOptionsFromConfig();
+    options.threads = 1;
+    std::vector<FrameMatch> exact;
+    double exactSeconds = exactNearestFrames(library, videoFrames, exact);
+
+    std::ofstream report(reportPath);
+    writeRecallHeader(report, videoPath, library, totalSampled, exactSeconds, "maxChecks");
+    for(unsigned long maxChecks: maxChecksList) {
+        options.mode = SEARCH_VP_TREE;
+        options.maxChecks = maxChecks;
+        NearestFrameSearcher searcher;
+        searcher.prepare(library, adLibraryPath, options, verbose);
+        writeRecallRow(report, maxChecks, searcher, videoFrames, exact, exactSeconds);
+    }
+    report.close();
+    if(verbose) {std::cout << "Recall report saved in:\n\t" << reportPath << std::endl;}
+    return 1;
+}
+
+// indexRecallReport for the compact codes (Config.compactDims dimensions), with each of the short list sizes.
+// avgDistances is the exact distances of the re-rank, on top of a scan of all the (much smaller) codes.
+int compactRecallReport(const String &videoPath, const String &adLibraryPath, const String &reportPath,
+        const std::vector<unsigned long> &shortlistList, bool verbose) {
+    AdLibrary library;
+    if(!openAdLibrary(library, adLibraryPath)) {return -1;}
+    double totalFrames;
+    long double duration;
+    FrameMatrix videoFrames = videoToFrameMatrix(videoPath, totalFrames, duration, verbose);
+    unsigned long totalSampled = videoFrames.rows();
+    if(totalSampled == 0) {
+        std::cerr << "ERROR: No frames sampled from " << videoPath << std::endl;
+        return -1;
+    }
+    SearchOptions options = searchOptionsFromConfig();
+    options.mode = SEARCH_COMPACT;
+    options.threads = 1;
+    std::vector<FrameMatch> exact;
+    double exactSeconds = exactNearestFrames(library, videoFrames, exact);
+
+    std::ofstream report(reportPath);
+    writeRecallHeader(report, videoPath, library, totalSampled, exactSeconds, "shortlist");
+    // The codes are built (or loaded) once, only the shortlist changes from row to row
+    NearestFrameSearcher searcher;
+    if(!searcher.prepare(library, adLibraryPath, options, verbose)) {return -1;}
+    for(unsigned long shortlist: shortlistList) {
+        searcher.setShortlist(shortlist);
+        writeRecallRow(report, shortlist, searcher, videoFrames, exact, exactSeconds);
+    }
+    report << "# codes: " << options.compactDims << " dimensions, " << compactIndexPath(adLibraryPath) << " is "
+           << fileBytes(compactIndexPath(adLibraryPath)) << " bytes against " << library.fileSize()
+           << " for the library\n";
+    report.close();
+    if(verbose) {std::cout << "Recall report saved in:\n\t" << reportPath << std::endl;}
+    return 1;
+}
+
+
+AdDirectory readAdDirectory(const String &adDirectoryPath) {
+    AdDirectory adDirectory;
+    std::ifstream file(adDirectoryPath);
+    std::string numbers;
+    std::string name;
+    // Getting the directory with ad info
+    while(std::getline(file, name)) {
+        std::getline(file, numbers);
+        std::stringstream lineStream(numbers);
+        lineStream = std::stringstream(numbers);
+        unsigned long totalFrames; double duration;
+        lineStream >> totalFrames >> duration;
+        adDirectory.add(name, VideoInfo(totalFrames, duration, sampleRate));
+    }
+    file.close();
+    return adDirectory;
+}
+
+// What the detector gets for a frame whose nearest ad frame is 'frame' (1-indexed) of ad 'ad', at distance 'dist'.
+// With Config.maxNearestDistance set, matches further than that count as no ad at all.
+NearestInfo nearestForDetection(int ad, int frame, unsigned long dist) {
+    if(Config.maxNearestDistance > 0 && dist > Config.maxNearestDistance) {return NearestInfo();}
+    return NearestInfo(ad, frame);
+}
+
+// Reads a nearest frames file in the old text format into frames by ad ID (see AdDirectory). False if it can't be
+// read, or it's cut short or has something other than a frame number where one should be.
+static bool readNearestFramesText(const String &nearestFramesFilePath, const AdDirectory &adDirectory,
+        std::string &videoName, unsigned long &totalFrames, double &duration, int &samplingRate,
+        std::vector<NearestInfo> &nearestFrames) {
+    std::string line;
+    std::ifstream file(nearestFramesFilePath);
+    // Title of the long video is...
+    if(!std::getline(file, videoName)) {return false;}
+    // Now for the headers (the frame count was written as a double):
+    double frameCount;
+    if(!std::getline(file, line) || !(std::stringstream(line) >> frameCount >> duration) || frameCount < 0) {
+        return false;
+    }
+    totalFrames = (unsigned long)frameCount;
+    // Admittedly, the second header was sort of added just on principle, since we do have them as globals too.
+    int sampleW, sampleH;
+    if(!std::getline(file, line) || !(std::stringstream(line) >> samplingRate >> sampleW >> sampleH)) {return false;}
+    // Reading file of nearest frames. Not sized from the header up front, so a broken one can't ask for any amount of
+    // memory: it runs out of lines first.
+    unsigned long totalSampled = amountSampled(totalFrames, sampleRate);
+    nearestFrames.clear();
+    std::string adName;
+    for(unsigned long frameInd = 0; frameInd < totalSampled; frameInd++){
+        if(!std::getline(file, adName) || !std::getline(file, line)) {return false;}
+        char *end;
+        long adFrame = std::strtol(line.c_str(), &end, 10);
+        if(end == line.c_str() || *end != '\0' || adFrame < 0 || adFrame > INT_MAX) {return false;}
+        // Names are looked up once here, everything after this goes by ID
+        nearestFrames.push_back(NearestInfo(adDirectory.find(adName), (int)adFrame));
+    }
+    return true;
+}
+
+// Reads a nearest frames file in either format into what the detector takes: frames by ad ID (see AdDirectory), with
+// Config.maxNearestDistance already applied. False if the file couldn't be read.
+bool readNearestFrames(const String &nearestFramesFilePath, const AdDirectory &adDirectory, std::string &videoName,
+        unsigned long &totalFrames, double &duration, int &samplingRate, std::vector<NearestInfo> &nearestFrames) {
+    if(NearestFramesFile::isBinary(nearestFramesFilePath)) {
+        // Straight off the mapping: the file's ad IDs are turned into the directory's once per ad, not per frame
+        NearestFramesFile file;
+        if(!file.open(nearestFramesFilePath)) {return false;}
+        videoName = file.videoName();
+        totalFrames = file.info().totalFrames;
+        duration = file.info().duration;
+        samplingRate = (int)file.info().sampleRate;
+        std::vector<int> adIds(file.adCount());
+        for(uint32_t ad = 0; ad < file.adCount(); ad++) {adIds[ad] = adDirectory.find(file.adName(ad));}
+        nearestFrames.resize(file.recordCount());
+        for(uint64_t frameInd = 0; frameInd < file.recordCount(); frameInd++) {
+            const NearestFrameRecord &record = file.record(frameInd);
+            int ad = record.ad < adIds.size() ? adIds[record.ad] : -1;
+            nearestFrames[frameInd] = nearestForDetection(ad, (int)record.adFrame, record.dist);
+        }
+    }
+    else {
+        // No distances in the text format, so nothing gets rejected
+        if(!readNearestFramesText(nearestFramesFilePath, adDirectory, videoName, totalFrames, duration, samplingRate,
+                                  nearestFrames)) {
+            std::cerr << "ERROR: Couldn't read nearest frames file " << nearestFramesFilePath << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int detectAds(const String &nearestFramesFilePath, const String &adDirectoryPath, const String &outFilePath) {
+    StageTimer timer(STAGE_DETECT_ADS);
+    StageCounters &counters = instruments().stage(STAGE_DETECT_ADS);
+    counters.bytesRead += fileBytes(nearestFramesFilePath) + fileBytes(adDirectoryPath);
+    // Getting the ad directory
+    AdDirectory adDirectory = readAdDirectory(adDirectoryPath);
+    std::string videoName;
+    unsigned long totalFrames;
+    double duration;
+    int samplingRate;
+    std::vector<NearestInfo> nearestFrames;
+    if(!readNearestFrames(nearestFramesFilePath, adDirectory, videoName, totalFrames, duration, samplingRate,
+                          nearestFrames)) {
+        return -1;
+    }
+    double fps = totalFrames/(duration/1000.0);
+    unsigned long totalSampled = nearestFrames.size();
+    std::ofstream outFile(outFilePath);
+    // Finding matches, in a single pass over the (sampled) frames of the long video. Each ad's tracker only ever
+    // looks at its own state, so this finds the same matches as going ad by ad, they just come out in the order
+    // they end in the video.
+    AdDetector detector(adDirectory, Config);
+    std::vector<Detection> detections;
+    for(unsigned long frameInd = 0; frameInd < totalSampled; frameInd++){
+        detections.clear();
+        detector.push(nearestFrames[frameInd], detections);
+        for(const Detection &detection: detections) {
+            writeDetection(outFile, videoName, detection, adDirectory, samplingRate, fps);
+        }
+    }
+    counters.framesTracked += totalSampled;
+    outFile.close();
+    return 1;
+}
+
+
+// Frame count, duration (ms) and frames per second of a video, worked out the same way videoToDescriptor and
+// detectAds do it. For live sources without a known length, the count and duration are 0 and fps is the container's.
+void probeVideo(const String &videoPath, unsigned long &totalFrames, double &duration, double &fps) {
+    VideoCapture cap(videoPath);
+    double frameCount = cap.get(CAP_PROP_FRAME_COUNT);
+    totalFrames = frameCount > 0 ? (unsigned long)frameCount : 0;
+    duration = 0;
+    if(totalFrames > 0) {
+        cap.set(CAP_PROP_POS_AVI_RATIO, 1);
+        duration = cap.get(CAP_PROP_POS_MSEC);
+    }
+    fps = duration > 0 ? totalFrames/(duration/1000.0) : cap.get(CAP_PROP_FPS);
+    cap.release();
+}
+
+// Streaming version of videoToDescriptor -> findNearestFrames -> detectAds. Decoding, descriptors, the nearest frame
+// search and the match trackers run at the same time as stages connected by bounded queues, so memory doesn't grow
+// with the length of the video (no list of frames, no nearest frames file), and every detection is written out as
+// soon as the frame that completes it comes through. The ad directory comes from the library itself.
+int streamDetectAds(const String &videoPath, const String &adLibraryPath, const String &outFilePath,
+        bool verbose, const SearchOptions &options) {
+    StageTimer timer(STAGE_STREAM_DETECT_ADS);
+    AdLibrary library;
+    if(!openAdLibrary(library, adLibraryPath)) {return -1;}
+    instruments().stage(STAGE_STREAM_DETECT_ADS).bytesRead += library.fileSize();
+    NearestFrameSearcher searcher;
+    if(!searcher.prepare(library, adLibraryPath, options, verbose)) {return -1;}
+    return streamDetectAds(videoPath, library, searcher, outFilePath, verbose, options.threads);
+}
+
+// The same with the library already open and the searcher already prepared on it (e.g. kept around by the server
+// for job after job). Only reads from both, so several of these can run on the same ones at once.
+int streamDetectAds(const String &videoPath, const AdLibrary &library, const NearestFrameSearcher &searcher,
+        const String &outFilePath, bool verbose, int threads) {
+    StageCounters &counters = instruments().stage(STAGE_STREAM_DETECT_ADS);
+    counters.bytesRead += fileBytes(videoPath);
+    // Library order, so ad IDs are the same as the library's ad indices
+    AdDirectory adDirectory;
+    for(uint32_t i = 0; i < library.adCount(); i++) {
+        const AdLibraryEntry &entry = library.entry(i);
+        adDirectory.add(library.name(i), VideoInfo(entry.totalFrames, entry.duration, sampleRate));
+    }
+    unsigned long totalFrames;
+    double duration, fps;
+    probeVideo(videoPath, totalFrames, duration, fps);
+    VideoCapture cap;
+    if(!openCapture(cap, videoPath, Config.descriptorBackend)) {
+        std::cerr << "ERROR: Couldn't open " << videoPath << std::endl;
+        return -1;
+    }
+    int frameHeight = (int)cap.get(CAP_PROP_FRAME_HEIGHT);
+    String videoName = extractNameFromPath(videoPath);
+    std::ofstream outFile(outFilePath);
+    if(!outFile) {
+        std::cerr << "ERROR: Couldn't write " << outFilePath << std::endl;
+        return -1;
+    }
+    if(verbose) {std::cout << "Streaming " << videoPath << " (" << fps << " fps)" << std::endl;}
+
+    struct SampledFrame {
+        unsigned long index;    // in sampled frames
+        Mat pixels;
+    };
+    struct SearchedFrame {
+        unsigned long index;
+        FrameMatch match;
+    };
+    BoundedQueue<SampledFrame> decoded(Config.streamQueueCapacity);
+    BoundedQueue<SampledFrame> descriptors(Config.streamQueueCapacity);
+    BoundedQueue<SearchedFrame> searched(Config.streamQueueCapacity);
+
+    // Decode: only the sampled frames get retrieved
+    std::thread decodeStage([&] {
+        Mat original;
+        unsigned long i = 0, retrieved = 0;
+        for(; cap.grab(); i++) {
+            if(i % sampleRate != 0) {continue;}
+            cap.retrieve(original);
+            retrieved++;
+            SampledFrame frame;
+            frame.index = i/sampleRate;
+            // retrieve() reuses its buffer, so the queued frame needs its own copy
+            frame.pixels = original.clone();
+            if(!decoded.push(std::move(frame))) {break;}
+        }
+        counters.framesDecoded += i;
+        counters.framesRetrieved += retrieved;
+        decoded.close();
+    });
+    // Descriptors
+    std::thread descriptorStage([&] {
+        SampledFrame frame;
+        FrameDescriber describer(Config.descriptorBackend, resizeW, resizeH);
+        while(decoded.pop(frame)) {
+            Mat descriptor;
+            describer.describe(frame.pixels, descriptor, frameHeight);
+            frame.pixels = descriptor;
+            if(!descriptors.push(std::move(frame))) {break;}
+        }
+        descriptors.close();
+    });
+    // Search results wait for their turn to be tracked (see below), but only frames less than streamQueueCapacity
+    // ahead of the next one to track get searched at all. Otherwise one slow search would let every later frame pile
+    // up waiting for it. The frame that's next is always let through, so this can't get stuck.
+    std::mutex trackedMutex;
+    std::condition_variable trackedChanged;
+    unsigned long tracked = 0;
+    // Nearest frame search, on as many threads as the options say. The last one out closes the results queue.
+    int searchThreads = threads <= 0 ? hardwareThreads() : threads;
+    std::atomic<int> searchersLeft(searchThreads);
+    std::vector<std::thread> searchStage;
+    for(int t = 0; t < searchThreads; t++) {
+        searchStage.emplace_back([&] {
+            SampledFrame frame;
+            SearchStats stats;
+            // This thread's last match, which helps the guided mode whenever the next frame it gets is the one right
+            // after (always, with a single search thread)
+            SearchedFrame last;
+            bool haveLast = false;
+            while(descriptors.pop(frame)) {
+                {
+                    std::unique_lock<std::mutex> lock(trackedMutex);
+                    trackedChanged.wait(lock, [&] {return frame.index < tracked + Config.streamQueueCapacity;});
+                }
+                SearchedFrame result;
+                result.index = frame.index;
+                bool consecutive = haveLast && frame.index == last.index + 1;
+                result.match = searcher.find(frame.pixels.ptr<uchar>(0), &stats, consecutive ? &last.match : nullptr);
+                last = result;
+                haveLast = true;
+                if(!searched.push(result)) {break;}
+            }
+            counters.framesSearched += stats.queries;
+            counters.distances += stats.distances;
+            if(--searchersLeft == 0) {searched.close();}
+        });
+    }
+    // Match tracking, here. Searches finish out of order, so results wait in 'pending' until it's their turn. Since
+    // searches only start that far ahead, it never holds more than streamQueueCapacity of them.
+    AdDetector detector(adDirectory, Config);
+    std::map<unsigned long, FrameMatch> pending;
+    std::vector<Detection> detections;
+    unsigned long nextIndex = 0;
+    SearchedFrame result;
+    while(searched.pop(result)) {
+        pending[result.index] = result.match;
+        for(auto next = pending.begin(); next != pending.end() && next->first == nextIndex; next = pending.begin()) {
+            const FrameMatch &match = next->second;
+            detections.clear();
+            // An empty library still gives a match (ad 0), which is no ad at all
+            int ad = match.ad < library.adCount() ? (int)match.ad : -1;
+            detector.push(nearestForDetection(ad, (int)match.adFrame + 1, (unsigned long)match.dist),
+                          detections);
+            for(const Detection &detection: detections) {
+                writeDetection(outFile, videoName, detection, adDirectory, sampleRate, fps);
+            }
+            pending.erase(next);
+            nextIndex++;
+            if(verbose && nextIndex % 1000 == 0) {std::cout << "Sampled video frames done: " << nextIndex << std::endl;}
+        }
+        std::lock_guard<std::mutex> lock(trackedMutex);
+        if(tracked != nextIndex) {
+            tracked = nextIndex;
+            trackedChanged.notify_all();
+        }
+    }
+    decodeStage.join();
+    descriptorStage.join();
+    for(std::thread &searchThread: searchStage) {searchThread.join();}
+    counters.framesTracked += nextIndex;
+    cap.release();
+    outFile.close();
+    if(verbose) {std::cout << "Done streaming, " << nextIndex << " sampled frames" << std::endl;}
+    return 1;
+}
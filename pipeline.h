@@ -0,0 +1,87 @@
+// The whole pipeline (ad library building, nearest frame search, ad detection), so it can be driven from more than
+// one executable (the main one and the benchmark).
+#ifndef RETRIEVALT1_PIPELINE_H
+#define RETRIEVALT1_PIPELINE_H
+#include <opencv2/opencv.hpp>
+#include "utils.h"
+#include "adlibrary.h"
+#include "search.h"
+#include "parallel.h"
+#include "detector.h"
+#include "instrumentation.h"
+#include "config.cpp"
+#include <string>
+#include <tuple>
+#include <vector>
+
+extern ConfigContainer Config;
+
+// A tuple represting the info in video's file of descriptors:
+//  <2D vect and each inner vect has the intensities of one of the sampled frames, total frames in original, duration>
+typedef std::tuple<std::vector<std::vector<int>>, long, double> DescriptorContainer;
+
+// Descriptors
+bool openCapture(cv::VideoCapture &cap, const cv::String &videoPath, DescriptorBackend backend);
+std::tuple<std::vector<cv::Mat>, double, long double> videoToDescriptor(const cv::String &videoPath,
+        bool verbose = false, int threads = 1, DescriptorBackend backend = Config.descriptorBackend,
+        unsigned long minSampledPerRange = Config.minSampledPerDecodeRange);
+bool sameDescriptor(const cv::Mat &a, const cv::Mat &b);
+// How far the descriptors of one backend are from another's on the same video
+struct DescriptorParity {
+    DescriptorBackend reference, candidate;
+    unsigned long frames;
+    double referenceSeconds, candidateSeconds;
+    double meanAbsDiff;         // per pixel
+    int maxAbsDiff;
+    double pixelsOver8;         // fraction of pixels off by more than 8 (of 255)
+    double meanFrameDistance;   // squared euclidean distance between the two versions of a frame, on average
+    DescriptorParity() {
+        reference = candidate = DESCRIPTOR_BGR_CUBIC; frames = 0; referenceSeconds = candidateSeconds = 0;
+        meanAbsDiff = 0; maxAbsDiff = 0; pixelsOver8 = 0; meanFrameDistance = 0;
+    }
+};
+bool compareDescriptorBackends(const cv::String &videoPath, DescriptorBackend reference, DescriptorBackend candidate,
+        DescriptorParity &parity, int threads = 1);
+int descriptorParityReport(const cv::String &videoPath, const cv::String &reportPath, bool verbose = false);
+FrameMatrix videoToFrameMatrix(const cv::String &videoPath, double &totalFrames, long double &duration,
+        bool verbose = false);
+bool videoRangeToFrameMatrix(const cv::String &videoPath, unsigned long seekFromSampled, unsigned long beginSampled,
+        unsigned long endSampled, unsigned long headLength, unsigned long seamSampled, unsigned long seamLength,
+        FrameMatrix &videoFrames, uint64_t &headHash, bool &headDistinct, uint64_t &seamHash, bool verbose = false);
+
+// Ad library
+bool openAdLibrary(AdLibrary &library, const cv::String &adLibraryPath);
+int makeVideoDescriptorFiles(const cv::String &inputFolder, const cv::String &extension,
+        const cv::String &libraryPath, const cv::String &directoryPath, bool verbose = false,
+        const cv::String &textExportFolder = "", int threads = Config.decodeThreads);
+DescriptorContainer readDescriptors(const cv::String &filePath);
+
+// Nearest frame search
+SearchOptions searchOptionsFromConfig();
+std::vector<FrameMatch> searchNearestFrames(const NearestFrameSearcher &searcher, const FrameMatrix &videoFrames,
+        const SearchOptions &options, SearchStats &stats, bool verbose = false);
+bool writeNearestFramesFile(const cv::String &outFilePath, const cv::String &videoName, double totalFrames,
+        long double duration, const std::vector<FrameMatch> &nearestFrames, const AdLibrary &library,
+        bool binary = Config.binaryNearestFrames);
+void findNearestFrames(const cv::String &videoPath, const cv::String &outFilePath,
+        const cv::String &adLibraryPath, bool verbose = false,
+        const SearchOptions &options = searchOptionsFromConfig());
+int indexRecallReport(const cv::String &videoPath, const cv::String &adLibraryPath, const cv::String &reportPath,
+        const std::vector<unsigned long> &maxChecksList, bool verbose = false);
+int compactRecallReport(const cv::String &videoPath, const cv::String &adLibraryPath, const cv::String &reportPath,
+        const std::vector<unsigned long> &shortlistList, bool verbose = false);
+
+// Detection
+AdDirectory readAdDirectory(const cv::String &adDirectoryPath);
+bool readNearestFrames(const cv::String &nearestFramesFilePath, const AdDirectory &adDirectory, std::string &videoName,
+        unsigned long &totalFrames, double &duration, int &samplingRate, std::vector<NearestInfo> &nearestFrames);
+int detectAds(const cv::String &nearestFramesFilePath, const cv::String &adDirectoryPath,
+        const cv::String &outFilePath);
+NearestInfo nearestForDetection(int ad, int frame, unsigned long dist);
+void probeVideo(const cv::String &videoPath, unsigned long &totalFrames, double &duration, double &fps);
+int streamDetectAds(const cv::String &videoPath, const cv::String &adLibraryPath, const cv::String &outFilePath,
+        bool verbose = false, const SearchOptions &options = searchOptionsFromConfig());
+int streamDetectAds(const cv::String &videoPath, const AdLibrary &library, const NearestFrameSearcher &searcher,
+        const cv::String &outFilePath, bool verbose = false, int threads = 1);
+
+#endif //RETRIEVALT1_PIPELINE_H
@@ -0,0 +1,114 @@
+#include "pruning.h"
+#include "utils.h"
+#include <algorithm>
+#include <numeric>
+
+static const int BLOCKS = PruningIndex::BLOCKS_PER_SIDE*PruningIndex::BLOCKS_PER_SIDE;
+
+// The bounds are worked out in doubles but distances are integers, so a bound only rejects a frame if it's over
+// the best by more than rounding could explain.
+static const double BOUND_MARGIN = 0.5;
+
+PruningIndex::PruningIndex() : frameW(0), frameH(0) {}
+
+void PruningIndex::blockSums(const uint8_t *frame, int32_t *sums) const {
+    std::fill(sums, sums + BLOCKS, 0);
+    for(int row = 0; row < frameH; row++) {
+        int blockRow = row*BLOCKS_PER_SIDE/frameH;
+        for(int col = 0; col < frameW; col++) {
+            sums[blockRow*BLOCKS_PER_SIDE + col*BLOCKS_PER_SIDE/frameW] += frame[row*frameW + col];
+        }
+    }
+}
+
+void PruningIndex::build(const AdLibrary &library) {
+    frameW = (int)library.frameW();
+    frameH = (int)library.frameH();
+    blockPixels.assign(BLOCKS, 0);
+    for(int row = 0; row < frameH; row++) {
+        for(int col = 0; col < frameW; col++) {
+            blockPixels[(row*BLOCKS_PER_SIDE/frameH)*BLOCKS_PER_SIDE + col*BLOCKS_PER_SIDE/frameW]++;
+        }
+    }
+    uint64_t total = library.totalSampled();
+    std::vector<int32_t> frameSums(total);
+    std::vector<int32_t> frameBlocks(total*BLOCKS);
+    for(uint64_t i = 0; i < total; i++) {
+        blockSums(library.frame(i), &frameBlocks[i*BLOCKS]);
+        frameSums[i] = std::accumulate(&frameBlocks[i*BLOCKS], &frameBlocks[i*BLOCKS] + BLOCKS, 0);
+    }
+    order.resize(total);
+    for(uint64_t i = 0; i < total; i++) {order[i] = (uint32_t)i;}
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {return frameSums[a] < frameSums[b];});
+    sums.resize(total);
+    blocks.resize(total*BLOCKS);
+    for(uint64_t i = 0; i < total; i++) {
+        sums[i] = frameSums[order[i]];
+        std::copy(&frameBlocks[order[i]*BLOCKS], &frameBlocks[order[i]*BLOCKS] + BLOCKS, &blocks[i*BLOCKS]);
+    }
+}
+
+uint64_t PruningIndex::nearest(const AdLibrary &library, const uint8_t *query, uint64_t bestIndex, long bestDist,
+                               long &dist, PruningCounts &counts, uint64_t skipBegin, uint64_t skipEnd) const {
+    int frameSize = frameW*frameH;
+    SquaredL2Func distance = squaredL2For(frameSize);
+    int32_t queryBlocks[BLOCKS];
+    blockSums(query, queryBlocks);
+    int32_t querySum = std::accumulate(queryBlocks, queryBlocks + BLOCKS, 0);
+    uint64_t skipped = skipEnd > skipBegin ? skipEnd - skipBegin : 0, skippedReached = 0;
+    // Looks at the frame in position 'pos' of the sorted order; false once its sum bound can't beat the best
+    auto visit = [&](size_t pos) {
+        if(order[pos] >= skipBegin && order[pos] < skipEnd) {
+            skippedReached++;
+            return true;
+        }
+        if(bestDist >= 0) {
+            double sumDiff = (double)(sums[pos] - querySum);
+            if(sumDiff*sumDiff/frameSize > bestDist + BOUND_MARGIN) {return false;}
+            const int32_t *frameBlocks = &blocks[pos*BLOCKS];
+            double bound = 0;
+            for(int j = 0; j < BLOCKS; j++) {
+                double blockDiff = (double)(frameBlocks[j] - queryBlocks[j]);
+                bound += blockDiff*blockDiff/blockPixels[j];
+            }
+            if(bound > bestDist + BOUND_MARGIN) {
+                counts.prunedByBlocks++;
+                return true;
+            }
+        }
+        uint32_t index = order[pos];
+        long d = bestDist < 0 ? distance(query, library.frame(index), frameSize)
+                              : squaredL2Bounded(query, library.frame(index), frameSize, bestDist);
+        if(bestDist >= 0 && d > bestDist) {
+            counts.abandoned++;
+            return true;
+        }
+        counts.full++;
+        // Same tie breaking as the exhaustive scan: smallest global index among the nearest
+        if(bestDist < 0 || d < bestDist || index < bestIndex) {
+            bestDist = d;
+            bestIndex = index;
+        }
+        return true;
+    };
+    // Start where the query's sum would go and walk outwards, one step each way at a time
+    size_t total = order.size();
+    size_t up = std::lower_bound(sums.begin(), sums.end(), querySum) - sums.begin();
+    size_t down = up;   // next one down is down - 1
+    bool goUp = up < total, goDown = down > 0;
+    while(goUp || goDown) {
+        if(goUp) {
+            goUp = visit(up);
+            if(goUp) {goUp = ++up < total;}
+        }
+        if(goDown) {
+            goDown = visit(down - 1);
+            if(goDown) {goDown = --down > 0;}
+        }
+    }
+    // Everything the walk didn't get to, but the frames it was told to skip, which the caller has distances for
+    counts.skippedBySum += total - (up - down) - (skipped - skippedReached);
+    counts.full += skipped;
+    dist = bestDist;
+    return bestIndex;
+}
@@ -0,0 +1,47 @@
+// Exact nearest-frame search that skips ad frames using cheap lower bounds on their distance to the query.
+#ifndef RETRIEVALT1_PRUNING_H
+#define RETRIEVALT1_PRUNING_H
+#include "adlibrary.h"
+#include <cstdint>
+#include <vector>
+
+// How a query went: every library frame ends up in exactly one of these
+struct PruningCounts {
+    unsigned long skippedBySum;     // never looked at, the scan by pixel sum stopped before reaching them
+    unsigned long prunedByBlocks;   // the block sums bound was already worse than the best
+    unsigned long abandoned;        // distance started but given up halfway
+    unsigned long full;             // distance computed all the way
+    PruningCounts() {skippedBySum = 0; prunedByBlocks = 0; abandoned = 0; full = 0;}
+};
+
+// For every library frame it keeps the sum of its pixels and the sums of a grid of blocks. By Cauchy-Schwarz,
+//     ||a-b||^2 >= sum over blocks j of (sumA_j - sumB_j)^2 / pixels_j >= (sumA - sumB)^2 / pixels
+// so frames can be rejected before computing their distance. Frames are kept sorted by total sum, and a query scans
+// outwards from its own sum in both directions, stopping each direction once the total sum bound alone can't beat
+// the best. Whatever survives both bounds gets a distance that is abandoned once it goes over the best.
+// Only frames that are strictly worse get skipped, so the answer (ties included) is the exhaustive scan's.
+class PruningIndex {
+public:
+    static const int BLOCKS_PER_SIDE = 4;
+
+    PruningIndex();
+    void build(const AdLibrary &library);
+    bool empty() const {return order.empty();}
+    // Global index of the nearest library frame. 'bestIndex'/'bestDist' can seed the search with a known candidate
+    // (bestDist < 0 means there's none), which makes for a tighter bound from the start. Frames [skipBegin, skipEnd)
+    // are the ones the seed was picked from: the caller already has their distances, so they're left out of the scan
+    // (and counted as full distances).
+    uint64_t nearest(const AdLibrary &library, const uint8_t *query, uint64_t bestIndex, long bestDist,
+                     long &dist, PruningCounts &counts, uint64_t skipBegin = 0, uint64_t skipEnd = 0) const;
+
+private:
+    void blockSums(const uint8_t *frame, int32_t *sums) const;
+
+    int frameW, frameH;
+    std::vector<int> blockPixels;       // pixels in each block
+    std::vector<uint32_t> order;        // library frames by increasing pixel sum
+    std::vector<int32_t> sums;          // pixel sum of order[i]
+    std::vector<int32_t> blocks;        // block sums of order[i], BLOCKS_PER_SIDE^2 of them per frame
+};
+
+#endif //RETRIEVALT1_PRUNING_H
@@ -0,0 +1,51 @@
+// Blocking queue with a fixed capacity, for handing frames between the stages of the streaming pipeline.
+#ifndef RETRIEVALT1_QUEUE_H
+#define RETRIEVALT1_QUEUE_H
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity == 0 ? 1 : capacity), closed(false) {}
+
+    // Waits while the queue is full. Returns false (and drops the item) if the queue was closed.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] {return closed || items.size() < capacity;});
+        if(closed) {return false;}
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Waits for an item. Returns false once the queue is closed and everything in it has been taken.
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] {return closed || !items.empty();});
+        if(items.empty()) {return false;}
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // No more pushes. Whatever is already queued can still be popped.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+#endif //RETRIEVALT1_QUEUE_H
@@ -0,0 +1,199 @@
+#include "search.h"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+FrameMatch bruteForceNearest(const AdLibrary &library, const uchar *query) {
+    FrameMatch best;
+    // 214748347 is the max long (so the max possible distance)
+    best.dist = 214748347;
+    int frameSize = (int)library.frameSize();
+    uint32_t stride = library.frameStride();
+    SquaredL2Func distance = squaredL2For(frameSize);
+    // All frames are back to back in the library, so just walk the block and keep track of which ad we're in
+    for(uint32_t adInd = 0; adInd < library.adCount(); adInd++) {
+        const AdLibraryEntry &currentAd = library.entry(adInd);
+        const uchar *adFrame = library.adFrame(adInd, 0);
+        for(uint64_t adFrameInd = 0; adFrameInd < currentAd.sampledFrames; adFrameInd++, adFrame += stride) {
+            long dist = distance(query, adFrame, frameSize);
+            if(dist < best.dist) {
+                best.ad = adInd;
+                best.adFrame = (uint32_t)adFrameInd;
+                best.dist = dist;
+            }
+        }
+    }
+    return best;
+}
+
+std::string vpTreePath(const std::string &libraryPath) {
+    return libraryPath + ".vpt";
+}
+
+NearestFrameSearcher::NearestFrameSearcher() : library(nullptr) {}
+
+bool NearestFrameSearcher::prepare(const AdLibrary &library, const std::string &libraryPath,
+                                   const SearchOptions &options, bool verbose) {
+    this->library = &library;
+    searchOptions = options;
+    if(options.mode == SEARCH_PRUNED || options.mode == SEARCH_GUIDED) {
+        // Cheap enough (one pass over the library) to just make on the spot
+        pruning.build(library);
+        return true;
+    }
+    if(options.mode == SEARCH_BATCHED) {
+        batched.build(library);
+        return true;
+    }
+    if(options.mode == SEARCH_COMPACT) {
+        std::string indexPath = compactIndexPath(libraryPath);
+        // An index asked for with another number of dimensions is as good as stale
+        if(compact.load(indexPath, library) && compact.requestedDims() == options.compactDims) {
+            if(verbose) {std::cout << "Loaded compact index " << indexPath << std::endl;}
+            return true;
+        }
+        if(verbose) {std::cout << "No up to date compact index at " << indexPath << ", building one..." << std::endl;}
+        compact.build(library, options.compactDims);
+        if(compact.save(indexPath, library) && verbose) {
+            std::cout << "Compact index (" << compact.dims() << " dimensions, " << compact.codeStride()
+                      << " bytes per frame instead of " << library.frameStride() << ") saved in:\n\t" << indexPath
+                      << std::endl;
+        }
+        return true;
+    }
+    if(options.mode != SEARCH_VP_TREE) {return true;}
+    std::string indexPath = vpTreePath(libraryPath);
+    if(tree.load(indexPath, library, options.leafSize)) {
+        if(verbose) {std::cout << "Loaded index " << indexPath << std::endl;}
+        return true;
+    }
+    if(verbose) {std::cout << "No up to date index at " << indexPath << ", building one..." << std::endl;}
+    tree.build(library, options.leafSize);
+    // Not being able to save it isn't fatal, it just gets built again next time
+    if(tree.save(indexPath, library) && verbose) {std::cout << "Index saved in:\n\t" << indexPath << std::endl;}
+    return true;
+}
+
+FrameMatch NearestFrameSearcher::find(const uchar *query, SearchStats *stats, const FrameMatch *previous) const {
+    if(searchOptions.mode == SEARCH_BATCHED) {
+        FrameMatch best;
+        findBlock(query, 1, 0, &best, stats);
+        return best;
+    }
+    FrameMatch best;
+    uint64_t index;
+    unsigned long distances;
+    if(searchOptions.mode == SEARCH_VP_TREE && library->totalSampled() > 0) {
+        index = tree.nearest(*library, query, searchOptions.maxChecks, best.dist, &distances);
+    }
+    else if(searchOptions.mode == SEARCH_COMPACT && !compact.empty()) {
+        index = compact.nearest(*library, query, searchOptions.shortlist, best.dist, &distances);
+    }
+    else if((searchOptions.mode == SEARCH_PRUNED || searchOptions.mode == SEARCH_GUIDED) &&
+            library->totalSampled() > 0) {
+        PruningCounts counts;
+        uint64_t guessIndex = 0, guessFirst = 0;
+        long guessDist = -1;
+        unsigned long guesses = 0;
+        if(searchOptions.mode == SEARCH_GUIDED && previous != nullptr && previous->ad < library->adCount()) {
+            // Where this frame should be if the ad keeps playing: the previous match and the few frames after it.
+            // Smallest index wins ties, same as everywhere else.
+            const AdLibraryEntry &ad = library->entry(previous->ad);
+            uint64_t first = ad.firstFrame + std::min<uint64_t>(previous->adFrame, ad.sampledFrames);
+            uint64_t last = std::min<uint64_t>(ad.firstFrame + ad.sampledFrames, first + searchOptions.guideWindow + 1);
+            int frameSize = (int)library->frameSize();
+            SquaredL2Func distance = squaredL2For(frameSize);
+            guessFirst = first;
+            for(uint64_t i = first; i < last; i++, guesses++) {
+                long d = distance(query, library->frame(i), frameSize);
+                if(guessDist < 0 || d < guessDist) {
+                    guessDist = d;
+                    guessIndex = i;
+                }
+            }
+        }
+        // The seed only tightens the bounds: anything that ties it with a smaller index still gets looked at. The
+        // guessed frames themselves aren't looked at again (they're in counts.full).
+        index = pruning.nearest(*library, query, guessIndex, guessDist, best.dist, counts, guessFirst,
+                                guessFirst + guesses);
+        distances = counts.abandoned + counts.full;
+        if(stats != nullptr) {
+            stats->pruning.skippedBySum += counts.skippedBySum;
+            stats->pruning.prunedByBlocks += counts.prunedByBlocks;
+            stats->pruning.abandoned += counts.abandoned;
+            stats->pruning.full += counts.full;
+            if(guesses > 0) {
+                stats->guided++;
+                stats->guessesConfirmed += index == guessIndex;
+            }
+        }
+    }
+    else {
+        best = bruteForceNearest(*library, query);
+        if(stats != nullptr) {
+            stats->queries++;
+            stats->candidates += library->totalSampled();
+            stats->distances += library->totalSampled();
+        }
+        return best;
+    }
+    best.ad = library->adOfFrame(index);
+    best.adFrame = (uint32_t)(index - library->entry(best.ad).firstFrame);
+    if(stats != nullptr) {
+        stats->queries++;
+        stats->candidates += library->totalSampled();
+        stats->distances += distances;
+    }
+    return best;
+}
+
+void NearestFrameSearcher::findBlock(const uchar *queries, unsigned long count, size_t queryStride,
+                                     FrameMatch *results, SearchStats *stats) const {
+    if(searchOptions.mode != SEARCH_BATCHED || library->totalSampled() == 0) {
+        for(unsigned long i = 0; i < count; i++) {
+            results[i] = find(queries + i*queryStride, stats, i > 0 ? &results[i - 1] : nullptr);
+        }
+        return;
+    }
+    std::vector<uint64_t> indices(count);
+    std::vector<long> dists(count);
+    batched.nearest(*library, queries, count, queryStride, indices.data(), dists.data());
+    for(unsigned long i = 0; i < count; i++) {
+        results[i].ad = library->adOfFrame(indices[i]);
+        results[i].adFrame = (uint32_t)(indices[i] - library->entry(results[i].ad).firstFrame);
+        results[i].dist = dists[i];
+    }
+    if(stats != nullptr) {
+        stats->queries += count;
+        stats->candidates += count*library->totalSampled();
+        stats->distances += count*library->totalSampled();
+    }
+}
+
+void SearchStats::add(const SearchStats &other) {
+    queries += other.queries;
+    candidates += other.candidates;
+    distances += other.distances;
+    pruning.skippedBySum += other.pruning.skippedBySum;
+    pruning.prunedByBlocks += other.pruning.prunedByBlocks;
+    pruning.abandoned += other.pruning.abandoned;
+    pruning.full += other.pruning.full;
+    guided += other.guided;
+    guessesConfirmed += other.guessesConfirmed;
+}
+
+void SearchStats::print(std::ostream &out) const {
+    double perCandidate = candidates > 0 ? 100.0/candidates : 0;
+    out << queries << " queries, " << distances << " distances for " << candidates << " candidates ("
+        << distances*perCandidate << "%)";
+    unsigned long pruned = pruning.skippedBySum + pruning.prunedByBlocks + pruning.abandoned + pruning.full;
+    if(pruned > 0) {
+        out << ". Skipped by sum: " << pruning.skippedBySum*perCandidate << "%, pruned by blocks: "
+            << pruning.prunedByBlocks*perCandidate << "%, abandoned: " << pruning.abandoned*perCandidate
+            << "%, full distances: " << pruning.full*perCandidate << "%";
+    }
+    if(guided > 0) {
+        out << ". Guessed " << guided << " queries, " << guessesConfirmed*100.0/guided << "% confirmed";
+    }
+    out << std::endl;
+}
@@ -0,0 +1,105 @@
+// Nearest-frame search over the ad library.
+#ifndef RETRIEVALT1_SEARCH_H
+#define RETRIEVALT1_SEARCH_H
+#include "adlibrary.h"
+#include "vptree.h"
+#include "pruning.h"
+#include "batched.h"
+#include "compact.h"
+#include "utils.h"
+#include <ostream>
+#include <string>
+
+// Where a video frame landed in the ad library
+struct FrameMatch {
+    uint32_t ad;
+    uint32_t adFrame;   // 0-indexed, relative to the ad's sampled frames
+    long dist;          // squared euclidean distance
+    FrameMatch() {ad = 0; adFrame = 0; dist = 0;}
+};
+
+// Exhaustive scan of every frame of every ad. Ties go to the first frame found (ad order, then frame order),
+// which every other search mode has to reproduce.
+FrameMatch bruteForceNearest(const AdLibrary &library, const uchar *query);
+
+enum SearchMode {
+    SEARCH_BRUTE_FORCE,
+    SEARCH_VP_TREE,
+    // Exact, skipping ad frames through lower bounds (see pruning.h)
+    SEARCH_PRUNED,
+    // Exact, every ad frame against blocks of video frames at a time (see batched.h)
+    SEARCH_BATCHED,
+    // Approximate: a short list from compact PCA codes, re-ranked exactly (see compact.h)
+    SEARCH_COMPACT,
+    // Exact: the frames right after the previous video frame's match get scored first, and the best of them seeds
+    // SEARCH_PRUNED's bounds. Inside an ad that's usually the answer already, so the pruning has little left to do.
+    SEARCH_GUIDED
+};
+
+// Counters over a bunch of queries. Each thread keeps its own and they get added up at the end.
+struct SearchStats {
+    unsigned long queries;
+    unsigned long candidates;       // library frames times queries
+    unsigned long distances;        // distance computations started (finished or abandoned)
+    PruningCounts pruning;          // SEARCH_PRUNED and SEARCH_GUIDED only
+    unsigned long guided;           // SEARCH_GUIDED: queries that had a previous match to start from
+    unsigned long guessesConfirmed; // ...and whose answer was one of the guessed frames
+    SearchStats() {queries = 0; candidates = 0; distances = 0; guided = 0; guessesConfirmed = 0;}
+    void add(const SearchStats &other);
+    // One line summary, with the pruning and guess rates if there were any
+    void print(std::ostream &out) const;
+};
+
+struct SearchOptions {
+    SearchMode mode;
+    // Threads for the loop over video frames (1 = serial, 0 = one per core) and frames per chunk
+    int threads;
+    unsigned long chunkSize;
+    // VP tree: frames per leaf, and distances per query before giving up (0 = exact)
+    uint32_t leafSize;
+    unsigned long maxChecks;
+    // Compact codes: PCA dimensions, and candidates re-ranked with the exact distance
+    int compactDims;
+    unsigned long shortlist;
+    // Guided: ad frames after the previous match that get scored before the rest (the previous one itself included)
+    uint32_t guideWindow;
+    SearchOptions() {
+        mode = SEARCH_BRUTE_FORCE; threads = 1; chunkSize = 64; leafSize = 16; maxChecks = 0;
+        compactDims = 32; shortlist = 64; guideWindow = 3;
+    }
+};
+
+// Where the VP tree of a library is kept
+std::string vpTreePath(const std::string &libraryPath);
+
+// Answers nearest-frame queries with whichever mode the options ask for. find() is safe to call from many threads.
+class NearestFrameSearcher {
+public:
+    NearestFrameSearcher();
+    // For the VP tree and compact modes this loads the library's index, or builds (and saves) it if it's missing or
+    // stale.
+    bool prepare(const AdLibrary &library, const std::string &libraryPath, const SearchOptions &options,
+                 bool verbose = false);
+    // 'stats' (if not null) gets this query's counts added to it. 'previous' is the match of the video frame right
+    // before this one, if the caller has it; only the guided mode uses it, and the answer is the same without it.
+    FrameMatch find(const uchar *query, SearchStats *stats = nullptr, const FrameMatch *previous = nullptr) const;
+    // find() for 'count' queries 'queryStride' bytes apart (e.g. rows of a FrameMatrix), into results[0..count).
+    // The batched mode answers them all in one go, the others one by one (the guided one taking each result as the
+    // next query's previous match, so the queries should be consecutive video frames).
+    void findBlock(const uchar *queries, unsigned long count, size_t queryStride, FrameMatch *results,
+                   SearchStats *stats = nullptr) const;
+    const SearchOptions &options() const {return searchOptions;}
+    // Only the compact mode's shortlist, which find() reads on every query: trying another one doesn't take a new
+    // prepare() (and with it loading the codes and fingerprinting the library again).
+    void setShortlist(unsigned long shortlist) {searchOptions.shortlist = shortlist;}
+
+private:
+    const AdLibrary *library;
+    SearchOptions searchOptions;
+    VpTree tree;
+    PruningIndex pruning;
+    BatchedSearch batched;
+    CompactIndex compact;
+};
+
+#endif //RETRIEVALT1_SEARCH_H
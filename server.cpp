@@ -0,0 +1,264 @@
+#include "server.h"
+#include "pipeline.h"
+#include "manifest.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Longest request line taken, anything past it gets the connection dropped
+static const size_t MAX_REQUEST_BYTES = 64*1024;
+
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while(std::getline(stream, field, '\t')) {fields.push_back(field);}
+    return fields;
+}
+
+// Reads up to the first newline (not included). False if the other side hung up before sending one, or sent too much.
+static bool readLine(int fd, std::string &line) {
+    line.clear();
+    char buffer[4096];
+    while(line.size() < MAX_REQUEST_BYTES) {
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if(got <= 0) {return false;}
+        const char *newline = (const char *)std::memchr(buffer, '\n', (size_t)got);
+        if(newline != nullptr) {
+            line.append(buffer, newline - buffer);
+            return true;
+        }
+        line.append(buffer, (size_t)got);
+    }
+    return false;
+}
+
+// MSG_NOSIGNAL so a client that went away doesn't SIGPIPE the whole server
+static bool writeAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while(sent < data.size()) {
+        ssize_t done = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(done <= 0) {return false;}
+        sent += (size_t)done;
+    }
+    return true;
+}
+
+static bool socketAddress(const std::string &socketPath, sockaddr_un &address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "ERROR: Socket path \"" << socketPath << "\" is empty or too long" << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return true;
+}
+
+MatchServer::MatchServer(const std::string &libraryPath, const std::string &socketPath, const SearchOptions &options,
+                         bool verbose) : libraryPath(libraryPath), socketPath(socketPath), options(options),
+                                         verbose(verbose), stopping(false), jobsRunning(0), jobsDone(0),
+                                         jobsFailed(0), reloads(0) {}
+
+std::shared_ptr<const LoadedLibrary> MatchServer::current() {
+    std::lock_guard<std::mutex> lock(loadedMutex);
+    return loaded;
+}
+
+bool MatchServer::reload(bool force) {
+    std::lock_guard<std::mutex> reloading(reloadMutex);
+    uint64_t size;
+    int64_t mtime;
+    if(!fileStat(libraryPath, size, mtime)) {
+        std::cerr << "ERROR: Couldn't stat ad library " << libraryPath << std::endl;
+        return false;
+    }
+    std::shared_ptr<const LoadedLibrary> old = current();
+    if(!force && old && old->size == size && old->mtime == mtime) {return true;}
+    // Built on the side while jobs keep going on the old one (which can take a while if an index has to be built)
+    std::shared_ptr<LoadedLibrary> fresh(new LoadedLibrary());
+    fresh->size = size;
+    fresh->mtime = mtime;
+    if(!openAdLibrary(fresh->library, libraryPath) ||
+       !fresh->searcher.prepare(fresh->library, libraryPath, options, verbose)) {
+        std::cerr << "ERROR: Couldn't load ad library " << libraryPath
+                  << (old ? ", keeping the one loaded before" : "") << std::endl;
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(loadedMutex);
+        loaded = fresh;
+    }
+    reloads++;
+    if(verbose) {
+        std::cout << "Loaded " << libraryPath << ": " << fresh->library.adCount() << " ads, "
+                  << fresh->library.totalSampled() << " sampled frames" << std::endl;
+    }
+    return true;
+}
+
+std::string MatchServer::handle(const std::string &request) {
+    std::vector<std::string> fields = splitFields(request);
+    if(fields.empty()) {return "ERROR empty request";}
+    const std::string &command = fields[0];
+    if(command == "status") {
+        std::shared_ptr<const LoadedLibrary> library = current();
+        std::ostringstream reply;
+        reply << "OK ads=" << library->library.adCount() << " frames=" << library->library.totalSampled()
+              << " running=" << jobsRunning << " done=" << jobsDone << " failed=" << jobsFailed
+              << " reloads=" << reloads;
+        return reply.str();
+    }
+    if(command == "reload") {return reload(true) ? "OK" : "ERROR couldn't load " + libraryPath;}
+    if(command == "quit") {
+        stopping = true;
+        return "OK";
+    }
+    if(command != "detect") {return "ERROR unknown request \"" + command + "\"";}
+    if(fields.size() < 3) {return "ERROR detect needs a video path and an output path";}
+    // Relative ones would be taken from wherever the server was started, which is rarely what the client meant
+    if(fields[1].empty() || fields[1][0] != '/' || fields[2].empty() || fields[2][0] != '/') {
+        return "ERROR detect needs absolute paths";
+    }
+    int threads = options.threads;
+    bool jobVerbose = verbose;
+    for(size_t i = 3; i < fields.size(); i++) {
+        size_t equals = fields[i].find('=');
+        std::string key = fields[i].substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : fields[i].substr(equals + 1);
+        if(key == "threads") {threads = std::atoi(value.c_str());}
+        else if(key == "verbose") {jobVerbose = value == "1";}
+        else {return "ERROR unknown parameter \"" + key + "\"";}
+    }
+    // Whatever is loaded right now, kept alive until the job is done even if a reload swaps it out meanwhile
+    std::shared_ptr<const LoadedLibrary> library = current();
+    auto start = std::chrono::steady_clock::now();
+    int result;
+    {
+        StageTimer timer(STAGE_STREAM_DETECT_ADS);
+        result = streamDetectAds(fields[1], library->library, library->searcher, fields[2], jobVerbose, threads);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(result != 1) {
+        jobsFailed++;
+        return "ERROR couldn't process " + fields[1];
+    }
+    jobsDone++;
+    std::ostringstream reply;
+    reply << "OK " << seconds;
+    return reply.str();
+}
+
+int MatchServer::run() {
+    if(!reload(true)) {return -1;}
+    sockaddr_un address;
+    if(!socketAddress(socketPath, address)) {return -1;}
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) {
+        std::cerr << "ERROR: Couldn't create a socket" << std::endl;
+        return -1;
+    }
+    // Left behind by a server that didn't get to clean up
+    unlink(socketPath.c_str());
+    if(bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        std::cerr << "ERROR: Couldn't listen on " << socketPath << std::endl;
+        close(listener);
+        return -1;
+    }
+    if(verbose) {std::cout << "Listening on " << socketPath << std::endl;}
+
+    // Checks the library file every so often, and reloads it when it's been replaced (e.g. by an incremental build)
+    std::thread watcher([this] {
+        auto lastCheck = std::chrono::steady_clock::now();
+        while(!stopping) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            if(std::chrono::steady_clock::now() - lastCheck < std::chrono::seconds(Config.serverReloadSeconds)) {
+                continue;
+            }
+            reload(false);
+            lastCheck = std::chrono::steady_clock::now();
+        }
+    });
+
+    // A thread per connection, but only Config.serverJobs of them work on jobs at a time; the rest (and any status
+    // or reload request) don't have to wait behind them. They're detached, so what they share is kept alive by
+    // them rather than by this function, and run() doesn't return before every one of them is done with 'this'.
+    struct Connections {
+        std::mutex mutex;
+        std::condition_variable changed;
+        int open = 0, jobs = 0;
+    };
+    std::shared_ptr<Connections> connections = std::make_shared<Connections>();
+    int maxJobs = Config.serverJobs <= 0 ? hardwareThreads() : Config.serverJobs;
+    while(!stopping) {
+        // Timed out every now and then, to notice a "quit"
+        pollfd waiting = {listener, POLLIN, 0};
+        if(poll(&waiting, 1, 500) <= 0) {continue;}
+        int client = accept(listener, nullptr, nullptr);
+        if(client < 0) {continue;}
+        {
+            std::lock_guard<std::mutex> lock(connections->mutex);
+            connections->open++;
+        }
+        std::thread([this, connections, client, maxJobs] {
+            std::string request;
+            if(readLine(client, request)) {
+                if(verbose) {std::cout << "Request: " << request << std::endl;}
+                bool isJob = request.compare(0, 7, "detect\t") == 0;
+                if(isJob) {
+                    std::unique_lock<std::mutex> lock(connections->mutex);
+                    connections->changed.wait(lock, [&] {return connections->jobs < maxJobs;});
+                    connections->jobs++;
+                    jobsRunning++;
+                }
+                std::string reply = handle(request);
+                if(isJob) {
+                    std::lock_guard<std::mutex> lock(connections->mutex);
+                    connections->jobs--;
+                    jobsRunning--;
+                    connections->changed.notify_all();
+                }
+                writeAll(client, reply + "\n");
+            }
+            close(client);
+            // Nothing of 'this' gets touched from here on
+            std::lock_guard<std::mutex> lock(connections->mutex);
+            connections->open--;
+            connections->changed.notify_all();
+        }).detach();
+    }
+    // No new connections from here on, but the ones already in get to finish
+    close(listener);
+    unlink(socketPath.c_str());
+    {
+        std::unique_lock<std::mutex> lock(connections->mutex);
+        connections->changed.wait(lock, [&] {return connections->open == 0;});
+    }
+    watcher.join();
+    if(verbose) {std::cout << "Stopped, " << jobsDone << " jobs done, " << jobsFailed << " failed" << std::endl;}
+    return 1;
+}
+
+bool sendServerRequest(const std::string &socketPath, const std::string &request, std::string &reply) {
+    sockaddr_un address;
+    if(!socketAddress(socketPath, address)) {return false;}
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {return false;}
+    if(connect(fd, (const sockaddr *)&address, sizeof(address)) != 0) {
+        std::cerr << "ERROR: No server listening on " << socketPath << std::endl;
+        close(fd);
+        return false;
+    }
+    bool ok = writeAll(fd, request + "\n") && readLine(fd, reply);
+    close(fd);
+    return ok;
+}
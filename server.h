@@ -0,0 +1,61 @@
+// Resident matcher: keeps the ad library (and its search index) loaded and takes jobs over a local Unix socket.
+#ifndef RETRIEVALT1_SERVER_H
+#define RETRIEVALT1_SERVER_H
+#include "adlibrary.h"
+#include "search.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Everything a job needs from the library, loaded together. Jobs hold on to the one they started with, so a reload
+// can swap in a new one while they're still running; the old one goes away with the last job using it.
+struct LoadedLibrary {
+    AdLibrary library;
+    NearestFrameSearcher searcher;
+    uint64_t size;          // of the file when it was loaded, to notice it being replaced
+    int64_t mtime;
+};
+
+// One request per connection, one line each, fields separated by tabs. Replies are one line too, starting with
+// "OK" or "ERROR".
+//   detect <video path> <output path> [threads=N] [verbose=1]
+//                       runs streamDetectAds on the loaded library, writing the detections to the output path. Both
+//                       paths have to be absolute.
+//   reload              loads the library again even if the file looks the same
+//   status              ads and frames loaded, jobs running and done so far
+//   quit                stops taking connections, lets running jobs finish and makes run() return
+class MatchServer {
+public:
+    MatchServer(const std::string &libraryPath, const std::string &socketPath, const SearchOptions &options,
+                bool verbose = false);
+    // Loads the library, then serves until a "quit" comes in. Config.serverJobs jobs run at the same time, and the
+    // library file is checked for changes every Config.serverReloadSeconds. 1 when it stopped normally, -1 if the
+    // library couldn't be loaded or the socket couldn't be set up.
+    int run();
+
+private:
+    MatchServer(const MatchServer &) = delete;
+    MatchServer &operator=(const MatchServer &) = delete;
+    // Loads the library if its file changed since the last load (or always, with 'force'). False if that was needed
+    // but failed, in which case the previous one stays in use.
+    bool reload(bool force);
+    std::shared_ptr<const LoadedLibrary> current();
+    std::string handle(const std::string &request);
+
+    const std::string libraryPath, socketPath;
+    const SearchOptions options;
+    const bool verbose;
+    std::mutex loadedMutex;     // guards 'loaded' (swapping it, or taking a reference to it)
+    std::mutex reloadMutex;     // one reload at a time
+    std::shared_ptr<const LoadedLibrary> loaded;
+    std::atomic<bool> stopping;
+    std::atomic<unsigned long> jobsRunning, jobsDone, jobsFailed, reloads;
+};
+
+// Sends one request line to a server and waits for its reply (without the newline). False if the server couldn't
+// be reached or hung up without replying.
+bool sendServerRequest(const std::string &socketPath, const std::string &request, std::string &reply);
+
+#endif //RETRIEVALT1_SERVER_H
@@ -0,0 +1,357 @@
+#include "shard.h"
+#include "pipeline.h"
+#include "nearestframes.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+std::vector<ShardPlan> planShards(unsigned long totalSampled, int shards, unsigned long overlap) {
+    std::vector<ShardPlan> plans;
+    unsigned long count = std::max(1UL, std::min((unsigned long)std::max(shards, 1), totalSampled));
+    unsigned long perShard = (totalSampled + count - 1)/count;
+    for(unsigned long begin = 0; begin < totalSampled; begin += perShard) {
+        ShardPlan plan;
+        plan.begin = begin;
+        plan.end = std::min(totalSampled, begin + perShard);
+        plan.warmStart = begin - std::min(begin, overlap);
+        plans.push_back(plan);
+    }
+    return plans;
+}
+
+unsigned long shardCheckLength(const ShardPlan &plan) {
+    return std::min(std::max(plan.begin - plan.warmStart, Config.seekCheckFrames), plan.end - plan.warmStart);
+}
+
+static std::string shardPathPrefix(const std::string &workFolder, const std::string &videoPath, int shard) {
+    return workFolder + "/" + extractNameFromPath(videoPath) + ".shard-" + std::to_string(shard);
+}
+
+std::string shardNearestPath(const std::string &workFolder, const std::string &videoPath, int shard) {
+    return shardPathPrefix(workFolder, videoPath, shard) + ".nearest";
+}
+
+std::string shardResultPath(const std::string &workFolder, const std::string &videoPath, int shard) {
+    return shardPathPrefix(workFolder, videoPath, shard) + ".result";
+}
+
+bool ShardResult::write(const std::string &path) const {
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::trunc);
+    file << plan.warmStart << ' ' << plan.begin << ' ' << plan.end << '\n';
+    file << seekFrom << ' ' << headHash << ' ' << headDistinct << ' ' << seamHash << '\n';
+    boundary.write(file);
+    end.write(file);
+    file << detections.size() << '\n';
+    for(const Detection &detection: detections) {file << detection.ad << ' ' << detection.matchStart << '\n';}
+    file.close();
+    // Renamed into place, so the coordinator never reads half of one
+    if(!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write shard result " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool ShardResult::read(const std::string &path) {
+    std::ifstream file(path);
+    size_t count;
+    if(!(file >> plan.warmStart >> plan.begin >> plan.end >> seekFrom >> headHash >> headDistinct >> seamHash) ||
+       !boundary.read(file) || !end.read(file) || !(file >> count)) {
+        return false;
+    }
+    detections.resize(count);
+    for(Detection &detection: detections) {
+        if(!(file >> detection.ad >> detection.matchStart)) {return false;}
+    }
+    return true;
+}
+
+// Tracks nearestFrames (sampled frames start.frameInd on) from the given detector state, appending what's completed
+// on frames of [plan.begin, plan.end) to 'detections'. Returns the state after the last frame, and if 'boundary'
+// isn't null, leaves the state right before frame plan.begin in it.
+static DetectorState trackShard(const AdDirectory &adDirectory, const DetectorState &start,
+        const std::vector<NearestInfo> &nearestFrames, const ShardPlan &plan, std::vector<Detection> &detections,
+        DetectorState *boundary) {
+    AdDetector detector(adDirectory, Config);
+    detector.restore(start);
+    std::vector<Detection> found;
+    for(unsigned long i = 0; i < nearestFrames.size(); i++) {
+        unsigned long frameInd = (unsigned long)start.frameInd + i;
+        if(frameInd == plan.begin && boundary != nullptr) {*boundary = detector.state();}
+        found.clear();
+        detector.push(nearestFrames[i], found);
+        if(frameInd >= plan.begin) {detections.insert(detections.end(), found.begin(), found.end());}
+    }
+    instruments().stage(STAGE_DETECT_ADS).framesTracked += nearestFrames.size();
+    return detector.state();
+}
+
+int runShard(const std::string &videoPath, const std::string &adLibraryPath, const std::string &adDirectoryPath,
+             const std::string &workFolder, int shard, const ShardPlan &plan, unsigned long seekFrom,
+             unsigned long seam, unsigned long seamLength, const SearchOptions &options, bool verbose) {
+    AdLibrary library;
+    if(!openAdLibrary(library, adLibraryPath)) {return -1;}
+    NearestFrameSearcher searcher;
+    if(!searcher.prepare(library, adLibraryPath, options, verbose)) {return -1;}
+    unsigned long totalFrames;
+    double duration, fps;
+    probeVideo(videoPath, totalFrames, duration, fps);
+    ShardResult result;
+    result.plan = plan;
+    result.seekFrom = seekFrom;
+    FrameMatrix videoFrames;
+    if(!videoRangeToFrameMatrix(videoPath, seekFrom, plan.warmStart, plan.end, shardCheckLength(plan), seam,
+                                seamLength, videoFrames, result.headHash, result.headDistinct, result.seamHash,
+                                verbose)) {
+        return -1;
+    }
+    SearchStats stats;
+    std::vector<FrameMatch> matches;
+    {
+        StageTimer timer(STAGE_FIND_NEAREST_FRAMES);
+        matches = searchNearestFrames(searcher, videoFrames, options, stats, verbose);
+    }
+    // Always the binary format: it's what the coordinator reads back when it has to track this shard again
+    std::string nearestPath = shardNearestPath(workFolder, videoPath, shard);
+    if(!writeNearestFramesFile(nearestPath, extractNameFromPath(videoPath), (double)totalFrames, duration, matches,
+                               library, true)) {
+        return -1;
+    }
+    // ...and read back through the same path detectAds takes, so the detector gets exactly what it would there
+    StageTimer timer(STAGE_DETECT_ADS);
+    AdDirectory adDirectory = readAdDirectory(adDirectoryPath);
+    std::string videoName;
+    unsigned long fileFrames;
+    double fileDuration;
+    int samplingRate;
+    std::vector<NearestInfo> nearestFrames;
+    if(!readNearestFrames(nearestPath, adDirectory, videoName, fileFrames, fileDuration, samplingRate,
+                          nearestFrames)) {
+        return -1;
+    }
+    result.end = trackShard(adDirectory, DetectorState((int)plan.warmStart), nearestFrames, plan, result.detections,
+                            &result.boundary);
+    if(verbose) {
+        std::cout << "Shard " << shard << ": " << result.detections.size() << " detections in sampled frames "
+                  << plan.begin << " to " << plan.end << std::endl;
+    }
+    return result.write(shardResultPath(workFolder, videoPath, shard)) ? 1 : -1;
+}
+
+static std::string shellQuote(const std::string &arg) {
+    std::string quoted = "'";
+    for(char c: arg) {
+        if(c == '\'') {quoted += "'\\''";}
+        else {quoted += c;}
+    }
+    return quoted + "'";
+}
+
+// The arguments as one command line, each of them quoted for a shell
+static std::string shellCommand(const std::vector<std::string> &args) {
+    std::string command;
+    for(const std::string &arg: args) {command += (command.empty() ? "" : " ") + shellQuote(arg);}
+    return command;
+}
+
+// Starts one worker: straight from its arguments, or if there's a Config.shardLauncher, as
+// /bin/sh -c "[launcher] [quoted worker command line]". The worker's command line goes to the launcher as a single
+// argument, quoted for the shell that runs it on the other end (ssh hands its arguments to the remote shell, which
+// would otherwise split paths with spaces all over again).
+static bool startWorker(const std::vector<std::string> &args, pid_t &pid) {
+    std::vector<std::string> argv = args;
+    if(!Config.shardLauncher.empty()) {
+        argv = {"sh", "-c", Config.shardLauncher + " " + shellQuote(shellCommand(args))};
+    }
+    std::vector<char *> pointers;
+    for(std::string &arg: argv) {pointers.push_back(&arg[0]);}
+    pointers.push_back(nullptr);
+    const char *path = Config.shardLauncher.empty() ? argv[0].c_str() : "/bin/sh";
+    return posix_spawn(&pid, path, nullptr, nullptr, pointers.data(), environ) == 0;
+}
+
+// Runs every worker (see startWorker), at most 'parallel' at a time. False if any of them couldn't be started or
+// didn't exit with 0.
+static bool runWorkers(const std::vector<std::vector<std::string>> &workers, int parallel, bool verbose) {
+    std::map<pid_t, size_t> running;
+    size_t next = 0;
+    bool allOk = true;
+    while(next < workers.size() || !running.empty()) {
+        while(next < workers.size() && (int)running.size() < parallel) {
+            if(verbose) {std::cout << "Starting: " << shellCommand(workers[next]) << std::endl;}
+            pid_t pid;
+            if(!startWorker(workers[next], pid)) {
+                std::cerr << "ERROR: Couldn't start " << shellCommand(workers[next]) << std::endl;
+                allOk = false;
+            }
+            else {running[pid] = next;}
+            next++;
+        }
+        if(running.empty()) {continue;}
+        int status;
+        pid_t done = waitpid(-1, &status, 0);
+        if(done < 0) {break;}
+        auto found = running.find(done);
+        if(found == running.end()) {continue;}
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "ERROR: Worker failed: " << shellCommand(workers[found->second]) << std::endl;
+            allOk = false;
+        }
+        running.erase(found);
+    }
+    return allOk && running.empty();
+}
+
+int shardedDetectAds(const std::string &videoPath, const std::string &adLibraryPath,
+                     const std::string &adDirectoryPath, const std::string &outFilePath,
+                     const std::string &workFolder, const std::string &workerExecutable, bool verbose,
+                     ShardMergeStats *stats) {
+    unsigned long totalFrames;
+    double duration, fps;
+    probeVideo(videoPath, totalFrames, duration, fps);
+    if(totalFrames == 0) {
+        std::cerr << "ERROR: Couldn't tell how long " << videoPath << " is, so it can't be sharded" << std::endl;
+        return -1;
+    }
+    std::vector<ShardPlan> plans = planShards(amountSampled(totalFrames, Config.sampleRate), Config.shardCount,
+                                              Config.shardOverlap);
+    // Each shard's worker also hashes the next one's check window (its seam), to check that one's seek with
+    auto worker = [&](size_t shard, unsigned long seekFrom) {
+        const ShardPlan &plan = plans[shard];
+        bool last = shard + 1 == plans.size();
+        unsigned long seam = last ? plan.end : plans[shard + 1].warmStart;
+        unsigned long seamLength = last ? 0 : shardCheckLength(plans[shard + 1]);
+        return std::vector<std::string>{workerExecutable, "shard", videoPath, adLibraryPath, adDirectoryPath,
+                                        workFolder, std::to_string(shard), std::to_string(plan.warmStart),
+                                        std::to_string(plan.begin), std::to_string(plan.end),
+                                        std::to_string(seekFrom), std::to_string(seam), std::to_string(seamLength)};
+    };
+    std::vector<std::vector<std::string>> workers;
+    for(size_t shard = 0; shard < plans.size(); shard++) {workers.push_back(worker(shard, plans[shard].warmStart));}
+    int parallel = Config.shardWorkers <= 0 ? (int)workers.size() : Config.shardWorkers;
+    if(!runWorkers(workers, parallel, verbose)) {return -1;}
+
+    std::vector<ShardResult> results(plans.size());
+    auto readResult = [&](size_t shard) {
+        const ShardPlan &plan = plans[shard];
+        std::string resultPath = shardResultPath(workFolder, videoPath, (int)shard);
+        ShardResult &result = results[shard];
+        // A hash of 0 is what a worker that didn't get its frames decoded would leave
+        if(!result.read(resultPath) || result.plan.warmStart != plan.warmStart || result.plan.begin != plan.begin ||
+           result.plan.end != plan.end || result.headHash == 0 || result.seamHash == 0) {
+            std::cerr << "ERROR: Missing or unexpected shard result " << resultPath << std::endl;
+            return false;
+        }
+        return true;
+    };
+    // A seek doesn't always land on the frame asked for (on GOP encoded video), so every shard's check window is
+    // held against the previous shard's decoding of it, in order: the previous one is already known to be right by
+    // then (the first one never seeks). A shard that doesn't match, or whose window is all one frame (which would
+    // match wherever the seek landed), is run again, decoding its way from the previous shard's seek on.
+    int reseeks = 0;
+    for(size_t shard = 0; shard < plans.size(); shard++) {
+        if(!readResult(shard)) {return -1;}
+        const ShardResult &result = results[shard];
+        if(shard == 0 || result.seekFrom == 0 ||
+           (result.headDistinct && result.headHash == results[shard - 1].seamHash)) {
+            continue;
+        }
+        reseeks++;
+        if(verbose) {
+            std::cout << "Shard " << shard << " didn't seek where it was asked to (or it couldn't be told), running "
+                      << "it again" << std::endl;
+        }
+        if(!runWorkers({worker(shard, results[shard - 1].seekFrom)}, 1, verbose) || !readResult(shard)) {return -1;}
+        if(results[shard].headHash != results[shard - 1].seamHash) {
+            std::cerr << "ERROR: Shard " << shard << " still doesn't start where the one before ends" << std::endl;
+            return -1;
+        }
+    }
+
+    // Merging, in shard order. 'exact' is always the state a single detector going through the whole video would be
+    // in at the start of the next shard.
+    StageTimer timer(STAGE_DETECT_ADS);
+    AdDirectory adDirectory = readAdDirectory(adDirectoryPath);
+    NearestFramesFile firstShard;
+    if(!firstShard.open(shardNearestPath(workFolder, videoPath, 0))) {return -1;}
+    std::string videoName = firstShard.videoName();
+    int samplingRate = (int)firstShard.info().sampleRate;
+    // Same as detectAds works it out from its nearest frames file
+    double fileFps = firstShard.info().totalFrames/(firstShard.info().duration/1000.0);
+    firstShard.close();
+    DetectorState exact(0);
+    std::vector<Detection> merged;
+    int reruns = 0;
+    for(size_t shard = 0; shard < plans.size(); shard++) {
+        const ShardPlan &plan = plans[shard];
+        const ShardResult &result = results[shard];
+        if(result.boundary == exact) {
+            merged.insert(merged.end(), result.detections.begin(), result.detections.end());
+            exact = result.end;
+            continue;
+        }
+        // The warm up wasn't long enough for this one: track its own frames again, from where the previous shard
+        // really left off
+        reruns++;
+        std::string nearestPath = shardNearestPath(workFolder, videoPath, (int)shard);
+        std::string shardVideoName;
+        unsigned long fileFrames;
+        double fileDuration;
+        int fileSamplingRate;
+        std::vector<NearestInfo> nearestFrames;
+        if(!readNearestFrames(nearestPath, adDirectory, shardVideoName, fileFrames, fileDuration, fileSamplingRate,
+                              nearestFrames) || nearestFrames.size() != plan.end - plan.warmStart) {
+            std::cerr << "ERROR: Couldn't read shard nearest frames " << nearestPath << std::endl;
+            return -1;
+        }
+        nearestFrames.erase(nearestFrames.begin(), nearestFrames.begin() + (plan.begin - plan.warmStart));
+        if(verbose) {
+            std::cout << "Shard " << shard << " didn't line up with the one before, tracking it again" << std::endl;
+        }
+        exact = trackShard(adDirectory, exact, nearestFrames, plan, merged, nullptr);
+    }
+    std::ofstream outFile(outFilePath);
+    for(const Detection &detection: merged) {
+        writeDetection(outFile, videoName, detection, adDirectory, samplingRate, fileFps);
+    }
+    outFile.close();
+    if(verbose) {
+        std::cout << plans.size() << " shards merged, " << reseeks << " of them decoded again, " << reruns
+                  << " tracked again, " << merged.size() << " detections" << std::endl;
+    }
+    if(stats != nullptr) {
+        stats->shards = (int)plans.size();
+        stats->reruns = reruns;
+        stats->reseeks = reseeks;
+    }
+    return outFile ? 1 : -1;
+}
+
+int shardWorkerMain(int argc, char **argv) {
+    if(argc != 13 || std::string(argv[1]) != "shard") {return -1;}
+    ShardPlan plan;
+    plan.warmStart = std::strtoul(argv[7], nullptr, 10);
+    plan.begin = std::strtoul(argv[8], nullptr, 10);
+    plan.end = std::strtoul(argv[9], nullptr, 10);
+    unsigned long seekFrom = std::strtoul(argv[10], nullptr, 10), seam = std::strtoul(argv[11], nullptr, 10);
+    unsigned long seamLength = std::strtoul(argv[12], nullptr, 10);
+    int shard = std::atoi(argv[6]);
+    return runShard(argv[2], argv[3], argv[4], argv[5], shard, plan, seekFrom, seam, seamLength,
+                    searchOptionsFromConfig()) == 1 ? 0 : 1;
+}
+
+std::string selfExecutablePath() {
+    char path[4096];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if(length <= 0) {return "";}
+    return std::string(path, (size_t)length);
+}
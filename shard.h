@@ -0,0 +1,91 @@
+// Splitting a long video into shards that separate worker processes (on this machine, or on others through a shared
+// folder) run the whole videoToDescriptor -> findNearestFrames -> detectAds chain on, and putting their detections
+// back together exactly as if a single process had gone through the whole video.
+#ifndef RETRIEVALT1_SHARD_H
+#define RETRIEVALT1_SHARD_H
+#include "detector.h"
+#include "search.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A shard owns sampled frames [begin, end) of the video: the detections completed on those frames are the ones it
+// reports. It starts tracking at warmStart (up to Config.shardOverlap frames earlier) so that by the time it gets
+// to 'begin' its trackers are, with luck, where the previous shard's are. That part is checked when merging.
+struct ShardPlan {
+    unsigned long warmStart, begin, end;
+    ShardPlan() {warmStart = 0; begin = 0; end = 0;}
+};
+
+// 'shards' (or fewer, for short videos) back to back shards over totalSampled sampled frames
+std::vector<ShardPlan> planShards(unsigned long totalSampled, int shards, unsigned long overlap);
+
+// A shard's check window is its first shardCheckLength sampled frames, from warmStart on: the whole overlap with the
+// previous shard (decoded by both workers anyway), but never fewer than Config.seekCheckFrames
+unsigned long shardCheckLength(const ShardPlan &plan);
+
+// What a worker leaves in the work folder, next to the shard's (binary) nearest frames file. Text, like so:
+//   [warmStart] [begin] [end]
+//   [seekFrom] [headHash] [headDistinct] [seamHash]
+//   [detector state right before frame begin]      (see DetectorState::write)
+//   [detector state after frame end - 1]
+//   [detections]
+//   [ad ID] [matchStart]                           (one line per detection, in the order they were completed)
+// seekFrom is the sampled frame the worker seeked to before decoding its way to warmStart. headHash and seamHash
+// are fnv1a64 hashes of the descriptors it got for the shard's check window and for the next shard's (see
+// shardCheckLength), for checking those seeks, and headDistinct (0 or 1) whether its own window could tell a seek
+// that landed off at all (see shardedDetectAds).
+struct ShardResult {
+    ShardPlan plan;
+    unsigned long seekFrom;
+    uint64_t headHash, seamHash;
+    bool headDistinct;
+    DetectorState boundary;
+    DetectorState end;
+    std::vector<Detection> detections;
+    ShardResult() {seekFrom = 0; headHash = 0; seamHash = 0; headDistinct = false;}
+    bool write(const std::string &path) const;
+    bool read(const std::string &path);
+};
+
+std::string shardNearestPath(const std::string &workFolder, const std::string &videoPath, int shard);
+std::string shardResultPath(const std::string &workFolder, const std::string &videoPath, int shard);
+
+// The worker side: descriptors, nearest frames and detection for sampled frames [warmStart, end) of the video,
+// decoding from a seek to sampled frame seekFrom (<= warmStart) on. The next shard's check window is sampled frames
+// [seam, seam + seamLength). Returns 1 when the shard's files got written, -1 if anything (decoding included) failed.
+int runShard(const std::string &videoPath, const std::string &adLibraryPath, const std::string &adDirectoryPath,
+             const std::string &workFolder, int shard, const ShardPlan &plan, unsigned long seekFrom,
+             unsigned long seam, unsigned long seamLength, const SearchOptions &options, bool verbose = false);
+
+struct ShardMergeStats {
+    int shards;
+    int reruns;         // shards whose trackers didn't line up with the previous one's and had to be re-tracked
+    int reseeks;        // shards whose seek landed off and had to be decoded again
+    ShardMergeStats() {shards = 0; reruns = 0; reseeks = 0;}
+};
+
+// The coordinator side: plans Config.shardCount shards, runs a worker process per shard ('workerExecutable' with
+// "shard ..." arguments, see shardWorkerMain, Config.shardWorkers at a time and through Config.shardLauncher if
+// there is one), and merges what they left into the same results file detectAds would write for the whole video.
+// Every worker but the first seeks to its warmStart, which on GOP encoded video can land a few frames off. So a
+// shard's check window has to match what the previous shard decoded for the same frames, and not be all one frame
+// (black, frozen), or it's run again decoding forward from the previous shard's seek point (which is known to be
+// right by then).
+// A shard's detections are taken as they are when its detector state at 'begin' equals the previous shard's state
+// at the end (which is exact, going from the first shard on). When it doesn't, the shard's detection is run again
+// from the previous shard's state over its nearest frames file, which is cheap next to decoding and searching.
+int shardedDetectAds(const std::string &videoPath, const std::string &adLibraryPath,
+                     const std::string &adDirectoryPath, const std::string &outFilePath,
+                     const std::string &workFolder, const std::string &workerExecutable, bool verbose = false,
+                     ShardMergeStats *stats = nullptr);
+
+// For the mains: if argv is "[program] shard [video] [ad library] [ad directory] [work folder] [shard] [warmStart]
+// [begin] [end] [seekFrom] [seam] [seamLength]", runs that worker and returns its exit code (0 when it went fine).
+// Returns -1 otherwise, without doing anything.
+int shardWorkerMain(int argc, char **argv);
+
+// Absolute path of the running executable (what shardedDetectAds can launch workers with)
+std::string selfExecutablePath();
+
+#endif //RETRIEVALT1_SHARD_H
@@ -2,6 +2,13 @@
 #include <iostream>
 #include <vector>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // With thanks to https://stackoverflow.com/a/4430900/4192226
 std::string extractNameFromPath(const std::string &fullPath) {
@@ -23,41 +30,240 @@ unsigned long amountSampled(unsigned long totalFrames, int sampleRate) {
     return (((totalFrames - 1)/ sampleRate) + 1);
 }
 
-// Euclidean distance func (without square-rooting)
-long euclideanDist(std::vector<int> &a, std::vector<int> &b) {
+// Plain loop version. Also does the leftover tail for the vector ones.
+long squaredL2Scalar(const uchar *a, const uchar *b, int length) {
     long res = 0;
-    // Assumes they're both the same size
-    for(unsigned long i = 0; i < a.size(); i++){
-        long diff = a[i] - b[i];
+    for(int i = 0; i < length; i++){
+        long diff = (int)a[i] - (int)b[i];
         res += diff*diff;
     }
     return res;
 }
 
-// Euclidian distance, but one argument is a Mat that we are gonna treat as a vector and the other actually a vector.
-long matVectEuclideanDist(cv::Mat &frame, std::vector<int> &desc) {
-    // Because I mean, why go over that Mat twice (once to make it a vect, another to caluclate dist)?
+#if defined(__x86_64__) || defined(__i386__)
+// For both vector versions: |a-b| comes from two saturating subtractions (one of them is always 0), then gets
+// widened to 16 bits and madd'd with itself, which squares and adds pairs of lanes into 32 bit sums.
+__attribute__((target("sse2")))
+long squaredL2SSE2(const uchar *a, const uchar *b, int length) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for(; i + 16 <= length; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i absDiff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i lo = _mm_unpacklo_epi8(absDiff, zero);
+        __m128i hi = _mm_unpackhi_epi8(absDiff, zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    long res = (long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return res + squaredL2Scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+long squaredL2AVX2(const uchar *a, const uchar *b, int length) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for(; i + 32 <= length; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i absDiff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i lo = _mm256_unpacklo_epi8(absDiff, zero);
+        __m256i hi = _mm256_unpackhi_epi8(absDiff, zero);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    long res = 0;
+    for(int lane = 0; lane < 8; lane++) {res += lanes[lane];}
+    return res + squaredL2SSE2(a + i, b + i, length - i);
+}
+#else
+// Not an x86 CPU, so these are just the plain loop (the compiler may still vectorize it for us).
+long squaredL2SSE2(const uchar *a, const uchar *b, int length) {return squaredL2Scalar(a, b, length);}
+long squaredL2AVX2(const uchar *a, const uchar *b, int length) {return squaredL2Scalar(a, b, length);}
+#endif
+
+// Fixed length versions: same as the ones above, but with 'Length' (a multiple of 32, so no tail) a compile time
+// constant. The vector ones keep two accumulators so consecutive madds don't wait on each other.
+template<int Length>
+static long squaredL2FixedScalar(const uchar *a, const uchar *b, int) {
     long res = 0;
-    unsigned long vecIndex = 0;
-    for(int row = 0; row < frame.rows; row++){
-        for(int col = 0; col < frame.cols; col++) {
-            long diff = (int)frame.at<uchar>(row, col) - desc[vecIndex++];
-            res += diff*diff;
-        }
+    for(int i = 0; i < Length; i++){
+        long diff = (int)a[i] - (int)b[i];
+        res += diff*diff;
     }
     return res;
 }
 
-// In case I actually end up just keeping everything in memory all the time
-long matMatEcuclideanDist(cv::Mat &a, cv::Mat &b) {
-    // Because I mean, why go over that Mat twice (once to make it a vect, another to caluclate dist)?
+#if defined(__x86_64__) || defined(__i386__)
+template<int Length>
+__attribute__((target("sse2")))
+static long squaredL2FixedSSE2(const uchar *a, const uchar *b, int) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+    for(int i = 0; i < Length; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i absDiff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i lo = _mm_unpacklo_epi8(absDiff, zero);
+        __m128i hi = _mm_unpackhi_epi8(absDiff, zero);
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(lo, lo));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(hi, hi));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+    return (long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+template<int Length>
+__attribute__((target("avx2")))
+static long squaredL2FixedAVX2(const uchar *a, const uchar *b, int) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    for(int i = 0; i < Length; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i absDiff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i lo = _mm256_unpacklo_epi8(absDiff, zero);
+        __m256i hi = _mm256_unpackhi_epi8(absDiff, zero);
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(lo, lo));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(hi, hi));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc0, acc1));
+    long res = 0;
+    for(int lane = 0; lane < 8; lane++) {res += lanes[lane];}
+    return res;
+}
+#endif
+
+// One of these per CPU level: the general version, and the fixed ones for 8x8, 16x16 and 32x32 descriptors
+struct SquaredL2Choice {
+    SquaredL2Func func;
+    SquaredL2Func fixed64, fixed256, fixed1024;
+    const char *name;
+};
+
+static SquaredL2Choice chooseSquaredL2() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return {squaredL2AVX2, squaredL2FixedAVX2<64>, squaredL2FixedAVX2<256>, squaredL2FixedAVX2<1024>, "avx2"};
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return {squaredL2SSE2, squaredL2FixedSSE2<64>, squaredL2FixedSSE2<256>, squaredL2FixedSSE2<1024>, "sse2"};
+    }
+#endif
+    return {squaredL2Scalar, squaredL2FixedScalar<64>, squaredL2FixedScalar<256>, squaredL2FixedScalar<1024>,
+            "scalar"};
+}
+
+// Function local static, so it's picked exactly once even if several threads get here at the same time.
+static const SquaredL2Choice &squaredL2Choice() {
+    static const SquaredL2Choice choice = chooseSquaredL2();
+    return choice;
+}
+
+long squaredL2(const uchar *a, const uchar *b, int length) {
+    return squaredL2Choice().func(a, b, length);
+}
+
+long squaredL2Bounded(const uchar *a, const uchar *b, int length, long bound) {
+    const SquaredL2Choice &choice = squaredL2Choice();
     long res = 0;
-    unsigned long vecIndex = 0;
-    for(int row = 0; row < a.rows; row++){
-        for(int col = 0; col < a.cols; col++) {
-            long diff = (int)a.at<uchar>(row, col) - (int)b.at<uchar>(row, col);
-            res += diff*diff;
-        }
+    int start = 0;
+    // Whole 64 pixel pieces go through the fixed version, the leftover (if any) through the general one
+    for(; start + 64 <= length; start += 64) {
+        res += choice.fixed64(a + start, b + start, 64);
+        if(res > bound) {return res;}
     }
+    if(start < length) {res += choice.func(a + start, b + start, length - start);}
     return res;
 }
+
+const char *squaredL2Kernel() {
+    return squaredL2Choice().name;
+}
+
+SquaredL2Func squaredL2For(int length) {
+    const SquaredL2Choice &choice = squaredL2Choice();
+    switch(length) {
+        case 64: return choice.fixed64;
+        case 256: return choice.fixed256;
+        case 1024: return choice.fixed1024;
+        default: return choice.func;
+    }
+}
+
+const char *squaredL2KernelFor(int length) {
+    // Spelled out so they can be handed back as plain literals
+    static const char *const fixedNames[3][3] = {{"avx2/64", "avx2/256", "avx2/1024"},
+                                                 {"sse2/64", "sse2/256", "sse2/1024"},
+                                                 {"scalar/64", "scalar/256", "scalar/1024"}};
+    const char *name = squaredL2Kernel();
+    int level = std::strcmp(name, "avx2") == 0 ? 0 : std::strcmp(name, "sse2") == 0 ? 1 : 2;
+    switch(length) {
+        case 64: return fixedNames[level][0];
+        case 256: return fixedNames[level][1];
+        case 1024: return fixedNames[level][2];
+        default: return name;
+    }
+}
+
+
+FrameMatrix::FrameMatrix() : buffer(nullptr), nRows(0), length(0), rowStride(0) {}
+
+FrameMatrix::FrameMatrix(unsigned long rows, int rowLength) : FrameMatrix() {
+    reset(rows, rowLength);
+}
+
+FrameMatrix::FrameMatrix(FrameMatrix &&other) : FrameMatrix() {
+    *this = std::move(other);
+}
+
+FrameMatrix &FrameMatrix::operator=(FrameMatrix &&other) {
+    if(this != &other) {
+        free(buffer);
+        buffer = other.buffer;
+        nRows = other.nRows;
+        length = other.length;
+        rowStride = other.rowStride;
+        other.buffer = nullptr;
+        other.nRows = 0;
+        other.length = 0;
+        other.rowStride = 0;
+    }
+    return *this;
+}
+
+FrameMatrix::~FrameMatrix() {
+    free(buffer);
+}
+
+void FrameMatrix::reset(unsigned long rows, int rowLength) {
+    free(buffer);
+    buffer = nullptr;
+    nRows = rows;
+    length = rowLength;
+    rowStride = ((rowLength + 31)/32)*32;
+    size_t bytes = std::max((size_t)rows*rowStride, (size_t)64);
+    void *memory = nullptr;
+    if(posix_memalign(&memory, 64, bytes) != 0) {throw std::bad_alloc();}
+    buffer = (uchar *)memory;
+    std::memset(buffer, 0, bytes);
+}
+
+void FrameMatrix::setRow(unsigned long i, const cv::Mat &frame) {
+    uchar *dst = row(i);
+    // Row by row, in case the Mat is a view into something bigger
+    for(int r = 0; r < frame.rows; r++) {
+        std::memcpy(dst, frame.ptr<uchar>(r), (size_t)frame.cols);
+        dst += frame.cols;
+    }
+}
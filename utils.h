@@ -6,8 +6,55 @@
 
 std::string extractNameFromPath(const std::string &fullPath);
 
-long euclideanDist(std::vector<int> &a, std::vector<int> &b);
-long matVectEuclideanDist(cv::Mat &frame, std::vector<int> &desc);
-long matMatEcuclideanDist(cv::Mat &a, cv::Mat &b);
 unsigned long amountSampled(unsigned long totalFrames, int sampleRate);
+
+// Euclidean distance (without square-rooting) between two uint8 descriptors of 'length' pixels.
+// Picks the AVX2, SSE2 or plain loop version the first time it's called, depending on what the CPU can do.
+// Sums are kept in 32 bit lanes, so length has to stay under ~33000 (a 181x181 descriptor).
+long squaredL2(const uchar *a, const uchar *b, int length);
+// squaredL2, but gives up as soon as the running sum goes over 'bound', returning that partial sum (so anything
+// > bound means "abandoned"). Checks every 64 pixels.
+long squaredL2Bounded(const uchar *a, const uchar *b, int length, long bound);
+// Name of the version squaredL2 ended up using ("avx2", "sse2" or "scalar")
+const char *squaredL2Kernel();
+// The individual versions, exposed so they can be checked against each other
+long squaredL2Scalar(const uchar *a, const uchar *b, int length);
+long squaredL2SSE2(const uchar *a, const uchar *b, int length);
+long squaredL2AVX2(const uchar *a, const uchar *b, int length);
+
+typedef long (*SquaredL2Func)(const uchar *a, const uchar *b, int length);
+// The version of squaredL2 to use for descriptors of exactly 'length' pixels. The common geometries (8x8, 16x16 and
+// 32x32) have versions compiled for that one length, with the trip count known so the loop gets fully unrolled;
+// any other length gets squaredL2's. The returned function still takes the length, but the fixed ones ignore it.
+// Callers should get it once (e.g. per query, from the library header's frame size) and then call it directly.
+SquaredL2Func squaredL2For(int length);
+// Name of what squaredL2For(length) ends up using, e.g. "avx2/256" for a fixed one or "avx2" otherwise
+const char *squaredL2KernelFor(int length);
+
+// A bunch of uint8 descriptors packed back to back in one 64-byte aligned buffer. Every row is padded (with zeroes)
+// to a multiple of 32 bytes, so each row starts aligned for the vector loads in squaredL2.
+class FrameMatrix {
+public:
+    FrameMatrix();
+    FrameMatrix(unsigned long rows, int rowLength);
+    FrameMatrix(FrameMatrix &&other);
+    FrameMatrix &operator=(FrameMatrix &&other);
+    ~FrameMatrix();
+    void reset(unsigned long rows, int rowLength);
+    unsigned long rows() const {return nRows;}
+    int rowLength() const {return length;}
+    int stride() const {return rowStride;}
+    uchar *row(unsigned long i) {return buffer + i*rowStride;}
+    const uchar *row(unsigned long i) const {return buffer + i*rowStride;}
+    // Copies a single channel uint8 Mat of rowLength pixels (e.g. a resized, grayscaled frame) into row i
+    void setRow(unsigned long i, const cv::Mat &frame);
+
+private:
+    FrameMatrix(const FrameMatrix &) = delete;
+    FrameMatrix &operator=(const FrameMatrix &) = delete;
+    uchar *buffer;
+    unsigned long nRows;
+    int length;
+    int rowStride;
+};
 #endif //RETRIEVALT1_UTILS_H
@@ -0,0 +1,164 @@
+#include "vptree.h"
+#include "utils.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <queue>
+
+// Header of a saved tree, followed by the nodes and then the bucket
+struct VpTreeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t leafSize;
+    uint64_t libraryFingerprint;
+    uint64_t libraryFrames;
+    uint64_t nodeCount;
+    uint64_t bucketSize;
+};
+
+// Triangle inequality bounds are done in doubles, so don't prune on differences smaller than this.
+static const double BOUND_SLACK = 1e-6;
+
+VpTree::VpTree() : leafSize(16) {}
+
+void VpTree::build(const AdLibrary &library, uint32_t leafSize) {
+    this->leafSize = std::max(leafSize, (uint32_t)1);
+    nodes.clear();
+    bucket.clear();
+    std::vector<uint32_t> items(library.totalSampled());
+    for(size_t i = 0; i < items.size(); i++) {items[i] = (uint32_t)i;}
+    // Fixed seed, so building twice from the same library gives the same tree
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    if(!items.empty()) {buildNode(library, items, 0, items.size(), seed);}
+}
+
+int32_t VpTree::buildNode(const AdLibrary &library, std::vector<uint32_t> &items, size_t begin, size_t end,
+                          uint64_t &seed) {
+    if(begin >= end) {return -1;}
+    int32_t index = (int32_t)nodes.size();
+    nodes.push_back(Node());
+    Node node;
+    std::memset(&node, 0, sizeof(node));
+    node.inside = node.outside = -1;
+    if(end - begin <= leafSize) {
+        node.bucketStart = (uint32_t)bucket.size();
+        node.bucketCount = (uint32_t)(end - begin);
+        bucket.insert(bucket.end(), items.begin() + begin, items.begin() + end);
+        nodes[index] = node;
+        return index;
+    }
+    // Random vantage point (xorshift), moved to the front of the range
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    std::swap(items[begin], items[begin + seed % (end - begin)]);
+    node.vantage = items[begin];
+    int frameSize = (int)library.frameSize();
+    SquaredL2Func distance = squaredL2For(frameSize);
+    const uint8_t *vantage = library.frame(node.vantage);
+    // Sort the rest by distance to the vantage point just enough to find the median
+    std::vector<std::pair<double, uint32_t>> byDist(end - begin - 1);
+    for(size_t i = begin + 1; i < end; i++) {
+        byDist[i - begin - 1] = std::make_pair(std::sqrt((double)distance(vantage, library.frame(items[i]), frameSize)),
+                                               items[i]);
+    }
+    size_t median = byDist.size()/2;
+    std::nth_element(byDist.begin(), byDist.begin() + median, byDist.end());
+    node.radius = byDist[median].first;
+    for(size_t i = 0; i < byDist.size(); i++) {items[begin + 1 + i] = byDist[i].second;}
+    // Everything before the median is <= radius and everything from it on is >= radius
+    size_t split = begin + 1 + median;
+    nodes[index] = node;
+    int32_t inside = buildNode(library, items, begin + 1, split, seed);
+    int32_t outside = buildNode(library, items, split, end, seed);
+    nodes[index].inside = inside;
+    nodes[index].outside = outside;
+    return index;
+}
+
+uint64_t VpTree::nearest(const AdLibrary &library, const uint8_t *query, unsigned long maxChecks,
+                         long &dist, unsigned long *checks) const {
+    int frameSize = (int)library.frameSize();
+    SquaredL2Func distance = squaredL2For(frameSize);
+    uint64_t bestIndex = 0;
+    long bestDist = -1;
+    unsigned long computed = 0;
+    // Smaller distance wins, and on ties the smaller global index (like the scan, which goes in index order)
+    auto consider = [&](uint32_t item) {
+        long d = distance(query, library.frame(item), frameSize);
+        computed++;
+        if(bestDist < 0 || d < bestDist || (d == bestDist && item < bestIndex)) {
+            bestDist = d;
+            bestIndex = item;
+        }
+        return d;
+    };
+    // Best-first: always expand the branch with the smallest lower bound on its distance to the query
+    typedef std::pair<double, int32_t> Pending;
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> pending;
+    if(!nodes.empty()) {pending.push(Pending(0.0, 0));}
+    while(!pending.empty()) {
+        Pending next = pending.top();
+        pending.pop();
+        if(bestDist >= 0 && next.first > std::sqrt((double)bestDist) + BOUND_SLACK) {break;}
+        if(maxChecks > 0 && computed >= maxChecks) {break;}
+        const Node &node = nodes[next.second];
+        if(node.bucketCount > 0) {
+            for(uint32_t i = 0; i < node.bucketCount; i++) {consider(bucket[node.bucketStart + i]);}
+            continue;
+        }
+        double toVantage = std::sqrt((double)consider(node.vantage));
+        if(node.inside >= 0) {pending.push(Pending(std::max(next.first, toVantage - node.radius), node.inside));}
+        if(node.outside >= 0) {pending.push(Pending(std::max(next.first, node.radius - toVantage), node.outside));}
+    }
+    dist = bestDist;
+    if(checks != nullptr) {*checks = computed;}
+    return bestIndex;
+}
+
+bool VpTree::save(const std::string &path, const AdLibrary &library) const {
+    VpTreeFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, VP_TREE_MAGIC, sizeof(VP_TREE_MAGIC));
+    header.version = VP_TREE_VERSION;
+    header.leafSize = leafSize;
+    header.libraryFingerprint = library.fingerprint();
+    header.libraryFrames = library.totalSampled();
+    header.nodeCount = nodes.size();
+    header.bucketSize = bucket.size();
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    if(!nodes.empty()) {file.write((const char *)nodes.data(), nodes.size()*sizeof(Node));}
+    if(!bucket.empty()) {file.write((const char *)bucket.data(), bucket.size()*sizeof(uint32_t));}
+    file.close();
+    if(!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "ERROR: Couldn't write index " << path << std::endl;
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool VpTree::load(const std::string &path, const AdLibrary &library, uint32_t leafSize) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) {return false;}
+    VpTreeFileHeader header;
+    file.read((char *)&header, sizeof(header));
+    if(!file || std::memcmp(header.magic, VP_TREE_MAGIC, sizeof(VP_TREE_MAGIC)) != 0 ||
+       header.version != VP_TREE_VERSION || header.libraryFrames != library.totalSampled() ||
+       header.leafSize != std::max(leafSize, (uint32_t)1) || header.libraryFingerprint != library.fingerprint()) {
+        return false;
+    }
+    this->leafSize = header.leafSize;
+    nodes.resize(header.nodeCount);
+    bucket.resize(header.bucketSize);
+    if(!nodes.empty()) {file.read((char *)nodes.data(), nodes.size()*sizeof(Node));}
+    if(!bucket.empty()) {file.read((char *)bucket.data(), bucket.size()*sizeof(uint32_t));}
+    if(!file) {
+        nodes.clear();
+        bucket.clear();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+// Vantage-point tree over all frames of the ad library, for answering nearest-frame queries without a full scan.
+#ifndef RETRIEVALT1_VPTREE_H
+#define RETRIEVALT1_VPTREE_H
+#include "adlibrary.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+const char VP_TREE_MAGIC[8] = {'A', 'D', 'V', 'P', 'T', 'R', 'E', 'E'};
+const uint32_t VP_TREE_VERSION = 1;
+
+class VpTree {
+public:
+    struct Node {
+        // Internal nodes: a library frame, and the (true, square-rooted) distance splitting the rest of the
+        // frames below it into 'inside' (<= radius) and 'outside' (>= radius).
+        uint32_t vantage;
+        int32_t inside, outside;   // child node indices, -1 if empty
+        double radius;
+        // Leaves: a range of 'bucket' holding the frames themselves
+        uint32_t bucketStart, bucketCount;
+    };
+
+    VpTree();
+    // Builds the tree over every frame of the library. Frames are split until at most leafSize are left.
+    void build(const AdLibrary &library, uint32_t leafSize);
+    // The file remembers the library's fingerprint and the leaf size, so load() refuses an index made for another
+    // library or with another leafSize than the one asked for.
+    bool save(const std::string &path, const AdLibrary &library) const;
+    bool load(const std::string &path, const AdLibrary &library, uint32_t leafSize);
+    bool empty() const {return nodes.empty();}
+
+    // Global index of the library frame nearest to 'query'. Goes best-first and stops when no branch can beat
+    // the best so far, which gives the same answer as the exhaustive scan (ties included). With maxChecks > 0 it
+    // also gives up after that many distance computations, which is the recall vs speed knob.
+    // 'dist' gets the squared distance and 'checks' (if not null) the amount of distances computed.
+    uint64_t nearest(const AdLibrary &library, const uint8_t *query, unsigned long maxChecks,
+                     long &dist, unsigned long *checks = nullptr) const;
+
+private:
+    int32_t buildNode(const AdLibrary &library, std::vector<uint32_t> &items, size_t begin, size_t end,
+                      uint64_t &seed);
+
+    uint32_t leafSize;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> bucket;
+};
+
+#endif //RETRIEVALT1_VPTREE_H